@@ -0,0 +1,205 @@
+/*
+ * In-kernel load test for the chsleep and scull devices.
+ *
+ * insmod spawns writer and reader kthreads that hammer one device with
+ * kernel_read()/kernel_write() for duration_ms, then logs ops/s, MB/s
+ * and average/max latency per side and returns. This takes syscall
+ * entry and copy_to_user out of the numbers, which drvbench can't.
+ *
+ *   insmod drv_selftest.ko path=/dev/scull0 readers=4 writers=1
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+MODULE_LICENSE("GPL");
+
+static char *path = "/dev/chsleep1";
+module_param(path, charp, 0444);
+MODULE_PARM_DESC(path, "Device node to test");
+
+static int readers = 1;
+module_param(readers, int, 0444);
+MODULE_PARM_DESC(readers, "Reader threads");
+
+static int writers = 1;
+module_param(writers, int, 0444);
+MODULE_PARM_DESC(writers, "Writer threads");
+
+static uint msg_size = 4096;
+module_param(msg_size, uint, 0444);
+MODULE_PARM_DESC(msg_size, "Bytes per read or write");
+
+static uint duration_ms = 5000;
+module_param(duration_ms, uint, 0444);
+MODULE_PARM_DESC(duration_ms, "Length of the run");
+
+/* Seekable devices (scull) cycle through [0, span) */
+static ulong span = 64 << 20;
+module_param(span, ulong, 0444);
+MODULE_PARM_DESC(span, "Offsets wrap at this many bytes");
+
+struct selftest_worker {
+	struct task_struct *task;
+	struct file *filp;
+	bool writer;
+	u64 ops;
+	u64 bytes;
+	u64 errors;
+	u64 lat_sum;
+	u64 lat_max;
+};
+
+static int selftest_thread(void *arg)
+{
+	struct selftest_worker *w = arg;
+	loff_t pos = 0;
+	ssize_t ret;
+	u64 start;
+	u64 lat;
+	char *buf;
+
+	buf = kvmalloc(msg_size, GFP_KERNEL);
+	if (buf)
+		memset(buf, w->writer ? 'w' : 0, msg_size);
+	/* The stop path kills us out of blocking waits */
+	allow_signal(SIGKILL);
+
+	while (!kthread_should_stop()) {
+		/* Every pass, EOF and error retries included */
+		cond_resched();
+		if (!buf || signal_pending(current)) {
+			/* Wait for kthread_stop(), we can't exit before it */
+			schedule_timeout_interruptible(HZ / 10);
+			continue;
+		}
+
+		if (pos + msg_size > span)
+			pos = 0;
+		start = ktime_get_ns();
+		if (w->writer)
+			ret = kernel_write(w->filp, buf, msg_size, &pos);
+		else
+			ret = kernel_read(w->filp, buf, msg_size, &pos);
+		lat = ktime_get_ns() - start;
+
+		if (ret < 0) {
+			if (ret != -EAGAIN && ret != -ETIMEDOUT &&
+			    ret != -ERESTARTSYS && ret != -EINTR)
+				w->errors++;
+			continue;
+		}
+		/* End of a seekable device, a writer may still be growing it */
+		if (!ret) {
+			pos = 0;
+			usleep_range(50, 100);
+			continue;
+		}
+
+		w->ops++;
+		w->bytes += ret;
+		w->lat_sum += lat;
+		if (lat > w->lat_max)
+			w->lat_max = lat;
+	}
+
+	kvfree(buf);
+	return 0;
+}
+
+static void selftest_report(const char *name, struct selftest_worker *ws, int n, u64 ns)
+{
+	u64 ops = 0, bytes = 0, errors = 0, lat_sum = 0, lat_max = 0;
+	int i;
+
+	if (!n)
+		return;
+	for (i = 0; i < n; i++) {
+		ops += ws[i].ops;
+		bytes += ws[i].bytes;
+		errors += ws[i].errors;
+		lat_sum += ws[i].lat_sum;
+		lat_max = max(lat_max, ws[i].lat_max);
+	}
+
+	pr_info("%s: %s %llu ops, %llu ops/s, %llu MB/s, avg %llu ns, max %llu ns, %llu errors\n",
+		path, name, ops, div64_u64(ops * NSEC_PER_SEC, ns),
+		div64_u64(bytes * (NSEC_PER_SEC / 1000000), ns),
+		ops ? div64_u64(lat_sum, ops) : 0, lat_max, errors);
+}
+
+static int __init selftest_init(void)
+{
+	struct selftest_worker *ws;
+	int nr = readers + writers;
+	int ret = 0;
+	u64 start;
+	int i;
+
+	if (readers < 0 || writers < 0 || !nr || !msg_size || span < msg_size)
+		return -EINVAL;
+
+	ws = kcalloc(nr, sizeof(*ws), GFP_KERNEL);
+	if (!ws)
+		return -ENOMEM;
+
+	/* Writers first, each with its own open file and position */
+	for (i = 0; i < nr; i++) {
+		ws[i].writer = i < writers;
+		ws[i].filp = filp_open(path, O_RDWR, 0);
+		if (IS_ERR(ws[i].filp)) {
+			ret = PTR_ERR(ws[i].filp);
+			ws[i].filp = NULL;
+			goto out;
+		}
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < nr; i++) {
+		ws[i].task = kthread_run(selftest_thread, &ws[i], "drv_selftest/%d", i);
+		if (IS_ERR(ws[i].task)) {
+			ret = PTR_ERR(ws[i].task);
+			ws[i].task = NULL;
+			break;
+		}
+	}
+	if (!ret)
+		msleep(duration_ms);
+
+	for (i = 0; i < nr; i++) {
+		if (!ws[i].task)
+			continue;
+		send_sig(SIGKILL, ws[i].task, 1);
+		kthread_stop(ws[i].task);
+	}
+
+	if (!ret) {
+		start = ktime_get_ns() - start;
+		selftest_report("write", ws, writers, start);
+		selftest_report("read", ws + writers, readers, start);
+	}
+
+out:
+	for (i = 0; i < nr; i++) {
+		if (ws[i].filp)
+			filp_close(ws[i].filp, NULL);
+	}
+	kfree(ws);
+	return ret;
+}
+
+static void __exit selftest_exit(void)
+{
+}
+
+module_init(selftest_init);
+module_exit(selftest_exit);
@@ -0,0 +1,520 @@
+/*
+ * Load generator for /dev/chsleepN and /dev/scullN.
+ *
+ * Runs writer and reader threads against one device for a fixed time
+ * and reports ops/s, MB/s and latency percentiles per side. The device
+ * type is found by probing ioctls, so any chsleep or scull node works.
+ *
+ *   drvbench -d /dev/chsleep1 -w 2 -r 2 -s 4096 -t 10
+ *   drvbench -d /dev/scull0 -m mmap -r 8 -w 1 -S 256M
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "scullb.h"
+#include "scull.h"
+
+/*
+ * Latency histogram: values below 16ns get their own bucket, above that
+ * each power of two is split in 16, so a bucket is within ~6% of the
+ * values it holds.
+ */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t max;
+};
+
+enum dev_type { DEV_CHSLEEP, DEV_SCULL };
+enum io_mode { MODE_RW, MODE_MMAP };
+
+struct config {
+	const char *path;
+	enum dev_type type;
+	enum io_mode mode;
+	size_t msg_size;
+	int readers;
+	int writers;
+	bool nonblock;
+	int seconds;
+	/* scull: offsets are spread over [0, span) */
+	uint64_t span;
+};
+
+struct worker {
+	pthread_t tid;
+	int id;
+	bool writer;
+	int fd;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t eagain;
+	/* Reads that returned 0, not counted as ops */
+	uint64_t empty;
+	uint64_t errors;
+	struct hist hist;
+};
+
+static struct config cfg = {
+	.path = "/dev/chsleep1",
+	.mode = MODE_RW,
+	.msg_size = 4096,
+	.readers = 1,
+	.writers = 1,
+	.seconds = 5,
+	.span = 64 << 20,
+};
+
+static volatile sig_atomic_t stop;
+
+/* Shared mapping for mmap mode */
+static char *map;
+static size_t map_len;
+static struct scullb_ring_hdr *ring;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v)
+{
+	int msb;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - 3) * HIST_SUB + ((v >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int idx)
+{
+	int msb;
+
+	if (idx < HIST_SUB)
+		return idx;
+	msb = idx / HIST_SUB + 3;
+	return (1ull << msb) | ((uint64_t)(idx % HIST_SUB) << (msb - 4));
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count[hist_index(v)]++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] += src->count[i];
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static uint64_t hist_pct(const struct hist *h, uint64_t total, double pct)
+{
+	uint64_t want = (uint64_t)(total * pct / 100.0);
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+	return h->max;
+}
+
+/* Per-thread xorshift, offsets only need to be spread out */
+static uint64_t next_rand(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static off_t scull_offset(uint64_t *seed)
+{
+	uint64_t slots = cfg.span / cfg.msg_size;
+
+	return (off_t)(next_rand(seed) % (slots ? slots : 1)) * cfg.msg_size;
+}
+
+/* Nonblocking syscall users park in poll() after EAGAIN */
+static void wait_ready(struct worker *w)
+{
+	struct pollfd pfd = {
+		.fd = w->fd,
+		.events = w->writer ? POLLOUT : POLLIN,
+	};
+
+	w->eagain++;
+	poll(&pfd, 1, 100);
+}
+
+static ssize_t do_rw(struct worker *w, char *buf, uint64_t *seed)
+{
+	if (cfg.type == DEV_SCULL) {
+		off_t off = scull_offset(seed);
+
+		return w->writer ? pwrite(w->fd, buf, cfg.msg_size, off) :
+				   pread(w->fd, buf, cfg.msg_size, off);
+	}
+	return w->writer ? write(w->fd, buf, cfg.msg_size) :
+			   read(w->fd, buf, cfg.msg_size);
+}
+
+static ssize_t do_scull_mmap(struct worker *w, char *buf, uint64_t *seed)
+{
+	off_t off = scull_offset(seed);
+
+	if (w->writer)
+		memcpy(map + off, buf, cfg.msg_size);
+	else
+		memcpy(buf, map + off, cfg.msg_size);
+	return cfg.msg_size;
+}
+
+/*
+ * One side of the chsleep ring protocol from scullb.h. Only one
+ * producer and one consumer may use the mapping.
+ */
+static ssize_t do_chsleep_mmap(struct worker *w, char *buf)
+{
+	char *data = map + ring->data_off;
+	uint32_t size = ring->size;
+	uint32_t wp, rp, used, idx, n, first;
+
+	if (w->writer) {
+		wp = ring->wp;
+		rp = __atomic_load_n(&ring->rp, __ATOMIC_ACQUIRE);
+		used = (wp - rp + 2 * size) % (2 * size);
+		if (size - used < cfg.msg_size) {
+			errno = EAGAIN;
+			return -1;
+		}
+		idx = wp % size;
+		first = size - idx < cfg.msg_size ? size - idx : cfg.msg_size;
+		memcpy(data + idx, buf, first);
+		memcpy(data, buf + first, cfg.msg_size - first);
+		__atomic_store_n(&ring->wp, (wp + cfg.msg_size) % (2 * size), __ATOMIC_RELEASE);
+		if (!used)
+			ioctl(w->fd, SCULLB_IOC_PRODUCED);
+		return cfg.msg_size;
+	}
+
+	rp = ring->rp;
+	wp = __atomic_load_n(&ring->wp, __ATOMIC_ACQUIRE);
+	used = (wp - rp + 2 * size) % (2 * size);
+	if (!used) {
+		errno = EAGAIN;
+		return -1;
+	}
+	n = used < cfg.msg_size ? used : cfg.msg_size;
+	idx = rp % size;
+	first = size - idx < n ? size - idx : n;
+	memcpy(buf, data + idx, first);
+	memcpy(buf + first, data, n - first);
+	__atomic_store_n(&ring->rp, (rp + n) % (2 * size), __ATOMIC_RELEASE);
+	if (used == size)
+		ioctl(w->fd, SCULLB_IOC_CONSUMED);
+	return n;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t seed = 0x9e3779b97f4a7c15ull * (w->id + 1);
+	uint64_t start;
+	ssize_t ret;
+	char *buf;
+
+	buf = malloc(cfg.msg_size);
+	if (!buf)
+		return NULL;
+	memset(buf, 'a' + w->id % 26, cfg.msg_size);
+
+	while (!stop) {
+		start = now_ns();
+		if (cfg.mode == MODE_RW)
+			ret = do_rw(w, buf, &seed);
+		else if (cfg.type == DEV_SCULL)
+			ret = do_scull_mmap(w, buf, &seed);
+		else
+			ret = do_chsleep_mmap(w, buf);
+
+		if (ret < 0) {
+			if (errno == EAGAIN) {
+				wait_ready(w);
+				continue;
+			}
+			if (errno == EINTR || errno == ETIMEDOUT)
+				continue;
+			w->errors++;
+			continue;
+		}
+		if (!ret) {
+			w->empty++;
+			continue;
+		}
+		hist_add(&w->hist, now_ns() - start);
+		w->ops++;
+		w->bytes += ret;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Only there so blocked syscalls return EINTR when the run ends */
+static void on_sigusr1(int sig)
+{
+	(void)sig;
+}
+
+static int probe(int fd)
+{
+	__u64 size;
+
+	if (!ioctl(fd, SCULLB_IOC_GSIZE, &size)) {
+		cfg.type = DEV_CHSLEEP;
+		return 0;
+	}
+	if (ioctl(fd, SCULL_IOC_VERSION) > 0) {
+		cfg.type = DEV_SCULL;
+		return 0;
+	}
+	fprintf(stderr, "%s: not a chsleep or scull device\n", cfg.path);
+	return -1;
+}
+
+/*
+ * Reads past the end return 0 (or SIGBUS through a mapping), so the
+ * whole span has to exist before the run starts.
+ */
+static int size_scull(int fd)
+{
+	__u64 span = cfg.span;
+
+	if (ioctl(fd, SCULL_IOC_TRUNCATE, &span) < 0) {
+		perror("SCULL_IOC_TRUNCATE");
+		return -1;
+	}
+	return 0;
+}
+
+static int setup_mmap(int fd)
+{
+	struct scullb_ring_hdr *hdr;
+
+	if (cfg.type == DEV_SCULL) {
+		map_len = cfg.span;
+		map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		return map == MAP_FAILED ? -1 : 0;
+	}
+
+	if (cfg.readers > 1 || cfg.writers > 1) {
+		fprintf(stderr, "chsleep mmap mode takes one reader and one writer\n");
+		return -1;
+	}
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return -1;
+	map_len = hdr->data_off + hdr->size;
+	if (hdr->flags & SCULLB_RING_RECORD) {
+		fprintf(stderr, "chsleep mmap mode needs a stream ring\n");
+		munmap(hdr, sizeof(*hdr));
+		return -1;
+	}
+	munmap(hdr, sizeof(*hdr));
+
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	ring = (struct scullb_ring_hdr *)map;
+	return 0;
+}
+
+static void report(const char *name, struct worker *ws, int n, double secs)
+{
+	struct hist h = { 0 };
+	uint64_t ops = 0, bytes = 0, eagain = 0, empty = 0, errors = 0;
+	int i;
+
+	if (!n)
+		return;
+	for (i = 0; i < n; i++) {
+		ops += ws[i].ops;
+		bytes += ws[i].bytes;
+		eagain += ws[i].eagain;
+		empty += ws[i].empty;
+		errors += ws[i].errors;
+		hist_merge(&h, &ws[i].hist);
+	}
+
+	printf("%-6s %12llu %12.0f %10.1f %9.2f %9.2f %9.2f %9.2f %10.2f %10llu %8llu %7llu\n",
+	       name, (unsigned long long)ops, ops / secs, bytes / secs / 1e6,
+	       hist_pct(&h, ops, 50) / 1e3, hist_pct(&h, ops, 90) / 1e3,
+	       hist_pct(&h, ops, 99) / 1e3, hist_pct(&h, ops, 99.9) / 1e3,
+	       h.max / 1e3, (unsigned long long)eagain, (unsigned long long)empty,
+	       (unsigned long long)errors);
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-m rw|mmap] [-s msg_size] [-r readers] [-w writers]\n"
+		"          [-n] [-t seconds] [-S scull_span]\n"
+		"  -n  open O_NONBLOCK, park in poll() on EAGAIN\n"
+		"  -S  scull only: spread offsets over this many bytes\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = on_sigusr1 };
+	struct worker *ws;
+	uint64_t start, end;
+	int nr, flags, fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "d:m:s:r:w:nt:S:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.path = optarg;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "mmap"))
+				cfg.mode = MODE_MMAP;
+			else if (strcmp(optarg, "rw"))
+				usage(argv[0]);
+			break;
+		case 's':
+			cfg.msg_size = parse_size(optarg);
+			break;
+		case 'r':
+			cfg.readers = atoi(optarg);
+			break;
+		case 'w':
+			cfg.writers = atoi(optarg);
+			break;
+		case 'n':
+			cfg.nonblock = true;
+			break;
+		case 't':
+			cfg.seconds = atoi(optarg);
+			break;
+		case 'S':
+			cfg.span = parse_size(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	nr = cfg.readers + cfg.writers;
+	if (!cfg.msg_size || cfg.readers < 0 || cfg.writers < 0 || !nr ||
+	    cfg.seconds <= 0 || cfg.span < cfg.msg_size)
+		usage(argv[0]);
+
+	flags = O_RDWR | (cfg.nonblock ? O_NONBLOCK : 0);
+	fd = open(cfg.path, flags);
+	if (fd < 0) {
+		perror(cfg.path);
+		return 1;
+	}
+	if (probe(fd))
+		return 1;
+	if (cfg.type == DEV_SCULL && size_scull(fd))
+		return 1;
+	if (cfg.mode == MODE_MMAP && setup_mmap(fd)) {
+		perror("mmap");
+		return 1;
+	}
+
+	/* No SA_RESTART, so a blocked read/write gives up when told to stop */
+	sigaction(SIGUSR1, &sa, NULL);
+
+	ws = calloc(nr, sizeof(*ws));
+	if (!ws)
+		return 1;
+	/* Writers first so report() can take each side as one slice */
+	for (i = 0; i < nr; i++) {
+		ws[i].id = i;
+		ws[i].writer = i < cfg.writers;
+		/* Each thread gets its own open file, and so its own f_pos */
+		ws[i].fd = open(cfg.path, flags);
+		if (ws[i].fd < 0) {
+			perror(cfg.path);
+			return 1;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr; i++)
+		pthread_create(&ws[i].tid, NULL, worker_fn, &ws[i]);
+	sleep(cfg.seconds);
+	stop = 1;
+	for (i = 0; i < nr; i++)
+		pthread_kill(ws[i].tid, SIGUSR1);
+	for (i = 0; i < nr; i++)
+		pthread_join(ws[i].tid, NULL);
+	end = now_ns();
+
+	printf("%s (%s), %s, %zu byte messages, %d writers, %d readers, %s, %d s\n",
+	       cfg.path, cfg.type == DEV_CHSLEEP ? "chsleep" : "scull",
+	       cfg.mode == MODE_MMAP ? "mmap" : "read/write", cfg.msg_size,
+	       cfg.writers, cfg.readers, cfg.nonblock ? "nonblocking" : "blocking",
+	       cfg.seconds);
+	printf("%-6s %12s %12s %10s %9s %9s %9s %9s %10s %10s %8s %7s\n",
+	       "op", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us",
+	       "p99.9 us", "max us", "eagain", "empty", "errors");
+	report("write", ws, cfg.writers, (end - start) / 1e9);
+	report("read", ws + cfg.writers, cfg.readers, (end - start) / 1e9);
+
+	for (i = 0; i < nr; i++)
+		close(ws[i].fd);
+	if (map)
+		munmap(map, map_len);
+	close(fd);
+	free(ws);
+	return 0;
+}
@@ -6,214 +6,1054 @@
 #include <linux/wait.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/io.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
 #include <linux/semaphore.h>
 #include <linux/jiffies.h>
 #include <linux/param.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/topology.h>
+#include <asm/barrier.h>
+#include "scullb.h"
 
-#define CONFIG_TIMEOUT
+#define CREATE_TRACE_POINTS
+#include "scullb_trace.h"
 
 MODULE_LICENSE("GPL");
 
+/* wp and rp run up to 2 * buflen, this keeps them within an int */
+#define SCULLB_MAX_BUFLEN (1U << 30)
+
 static unsigned int buflen = 10;
-module_param(buflen, uint, 0444);
+
+/* Accepts K/M/G suffixes, e.g. buflen=64M */
+static int buflen_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned long long size;
+	char *end;
+
+	size = memparse(val, &end);
+	if (*end && *end != '\n')
+		return -EINVAL;
+	if (!size || size > SCULLB_MAX_BUFLEN)
+		return -EINVAL;
+	*(unsigned int *)kp->arg = size;
+	return 0;
+}
+
+static const struct kernel_param_ops buflen_ops = {
+	.set = buflen_set,
+	.get = param_get_uint,
+};
+module_param_cb(buflen, &buflen_ops, &buflen, 0444);
+MODULE_PARM_DESC(buflen, "Ring size in bytes, up to 1G");
+
+/*
+ * Single producer/single consumer mode: the reader only ever moves rp and
+ * the writer only ever moves wp, so no lock is needed around the copy.
+ * Only safe if userspace guarantees at most one reader and one writer.
+ */
+static bool spsc;
+module_param(spsc, bool, 0444);
+MODULE_PARM_DESC(spsc, "Lockless single-producer/single-consumer ring mode");
+
+/*
+ * Record mode: each write() is queued as one length prefixed record and
+ * each read() returns exactly one record.
+ */
+static bool record;
+module_param(record, bool, 0444);
+MODULE_PARM_DESC(record, "Keep message boundaries, one record per write");
+
+/*
+ * Wake thresholds, like SO_RCVLOWAT/SO_SNDLOWAT: blocked readers are only
+ * woken once rcvlowat bytes are queued and blocked writers once sndlowat
+ * bytes are free. Per device values can be changed with SCULLB_IOC_SLOWAT.
+ */
+static unsigned int rcvlowat = 1;
+module_param(rcvlowat, uint, 0444);
+MODULE_PARM_DESC(rcvlowat, "Bytes queued before blocked readers are woken");
+
+static unsigned int sndlowat = 1;
+module_param(sndlowat, uint, 0444);
+MODULE_PARM_DESC(sndlowat, "Bytes free before blocked writers are woken");
+
+/*
+ * Blocking readers and writers first busy poll for up to spin_us, which
+ * saves the sleep/wakeup round trip when the other side is about to
+ * catch up, then sleep for at most timeout_ms (0 waits forever) and
+ * fail with -ETIMEDOUT. Per device values are set with SCULLB_IOC_SWAIT.
+ */
+static unsigned int spin_us;
+module_param(spin_us, uint, 0444);
+MODULE_PARM_DESC(spin_us, "Microseconds to busy poll before sleeping");
+
+static unsigned int timeout_ms = 10000;
+module_param(timeout_ms, uint, 0444);
+MODULE_PARM_DESC(timeout_ms, "Blocking read/write timeout in ms, 0 for none");
+
+/* Devices are named chsleep1..chsleepN, device i is meant for cpu i - 1 */
+static unsigned int ndevs = 1;
+module_param(ndevs, uint, 0444);
+MODULE_PARM_DESC(ndevs, "Number of independent ring devices");
+
+/* Ring occupancy after each transfer, in eighths of buflen */
+#define SCULLB_OCC_BUCKETS 8
+
+/* Per cpu counters, summed when read through debugfs */
+struct scullb_stats {
+	u64 rd_ops;
+	u64 wr_ops;
+	u64 rd_bytes;
+	u64 wr_bytes;
+	/* Time spent spinning or sleeping for the other side */
+	u64 blocked_ns;
+	u64 eagain;
+	u64 occupancy[SCULLB_OCC_BUCKETS];
+};
 
 struct scull_device {
 	struct miscdevice miscd;
+	char name[16];
+	/* NUMA node the ring memory was allocated on */
+	int node;
 	/* Queue for blocked readers */
 	wait_queue_head_t inq;
 	/* Queue for blocked writers */
 	wait_queue_head_t outq;
-	/* Read and write trackers */
-	int wp;
-	int rp;
-	/* Data buffer */
+	/*
+	 * Read and write trackers live in the header page shared with mmap
+	 * users. Each side publishes its own index with a release store and
+	 * reads the other side's with an acquire load; they sit on separate
+	 * cache lines so producer and consumer don't bounce a shared line.
+	 */
+	struct scullb_ring_hdr *hdr;
+	/* Data buffer, the pages following hdr */
 	char *buf;
 	unsigned int buflen;
-    /* Lock to handle serialization */
+	/* Bytes covered by hdr + buf, and whether they are physically contiguous */
+	size_t mapsize;
+	bool contig;
+	bool spsc;
+	bool record;
+	/* Wake thresholds, always within [1, buflen] */
+	unsigned int rcvlowat;
+	unsigned int sndlowat;
+	/* Blocked readers that will take less than rcvlowat */
+	atomic_t short_readers;
+	/* Busy poll window and sleep limit for blocking callers */
+	unsigned int spin_us;
+	unsigned int timeout_ms;
+    /* Lock to handle serialization, unused in spsc mode */
 	struct semaphore sem;
-} scullb;
+	/* Processes that asked for SIGIO */
+	struct fasync_struct *async_queue;
+	struct scullb_stats __percpu *stats;
+};
+
+static struct scull_device **scullb_devs;
+/* /sys/kernel/debug/chsleep, one stats file per device */
+static struct dentry *scullb_debugfs;
+
+/* misc_open() stores the miscdevice in private_data */
+static inline struct scull_device *scullb_dev(struct file *filp)
+{
+	return container_of(filp->private_data, struct scull_device, miscd);
+}
+
+static inline int scullb_lock(struct scull_device *dev)
+{
+	if (dev->spsc)
+		return 0;
+	return down_interruptible(&dev->sem);
+}
+
+static inline void scullb_unlock(struct scull_device *dev)
+{
+	if (!dev->spsc)
+		up(&dev->sem);
+}
+
+/*
+ * wp and rp run over [0, 2 * buflen) rather than [0, buflen), so a full
+ * ring (wp - rp == buflen) can be told apart from an empty one without
+ * sacrificing a slot.
+ */
+static inline unsigned int scullb_used(struct scull_device *dev, unsigned int wp, unsigned int rp)
+{
+	return (wp + 2 * dev->buflen - rp) % (2 * dev->buflen);
+}
+
+/* Position of an index inside buf */
+static inline unsigned int scullb_pos(struct scull_device *dev, unsigned int idx)
+{
+	return idx < dev->buflen ? idx : idx - dev->buflen;
+}
+
+static inline unsigned int scullb_advance(struct scull_device *dev, unsigned int idx, unsigned int n)
+{
+	return (idx + n) % (2 * dev->buflen);
+}
+
+/*
+ * An mmap user can scribble anything into the header page, so indices
+ * are reduced into range whenever they are loaded.
+ */
+static inline unsigned int scullb_wp(struct scull_device *dev)
+{
+	return smp_load_acquire(&dev->hdr->wp) % (2 * dev->buflen);
+}
+
+static inline unsigned int scullb_rp(struct scull_device *dev)
+{
+	return smp_load_acquire(&dev->hdr->rp) % (2 * dev->buflen);
+}
+
+/* Called by the reader, wp is owned by the writer */
+static inline bool scullb_empty(struct scull_device *dev)
+{
+	return scullb_wp(dev) == scullb_rp(dev);
+}
+
+/* Called by the reader. Corrupt indices read as more than buflen queued */
+static inline unsigned int scullb_queued(struct scull_device *dev)
+{
+	return scullb_used(dev, scullb_wp(dev), scullb_rp(dev));
+}
+
+/* Called by the writer, rp is owned by the reader. Corrupt indices read as no space */
+static inline unsigned int scullb_space(struct scull_device *dev)
+{
+	unsigned int used = scullb_used(dev, scullb_wp(dev), scullb_rp(dev));
+
+	return used < dev->buflen ? dev->buflen - used : 0;
+}
+
+/*
+ * Wait condition for scullb_wait(), like scullb_readable() below.
+ * Blocking writers wait for the room they need and for sndlowat, the
+ * same threshold scullb_consumed() wakes them on. sndlowat is re-read on
+ * every check so SCULLB_IOC_SLOWAT reaches writers already asleep.
+ */
+static bool scullb_writable(struct scull_device *dev, unsigned int need)
+{
+	return scullb_space(dev) >= max(need, READ_ONCE(dev->sndlowat));
+}
+
+/*
+ * Copy n bytes starting at index rp out of the ring, in two segments if
+ * the data wraps past the end of buf. Returns the number of bytes copied.
+ */
+static size_t scullb_copy_to_iter(struct scull_device *dev, unsigned int rp,
+				  size_t n, struct iov_iter *to)
+{
+	unsigned int off = scullb_pos(dev, rp);
+	size_t first = min_t(size_t, n, dev->buflen - off);
+	size_t copied;
+
+	copied = copy_to_iter(&dev->buf[off], first, to);
+	if (copied < first)
+		return copied;
+	return first + copy_to_iter(dev->buf, n - first, to);
+}
+
+static size_t scullb_copy_from_iter(struct scull_device *dev, unsigned int wp,
+				    size_t n, struct iov_iter *from)
+{
+	unsigned int off = scullb_pos(dev, wp);
+	size_t first = min_t(size_t, n, dev->buflen - off);
+	size_t copied;
+
+	copied = copy_from_iter(&dev->buf[off], first, from);
+	if (copied < first)
+		return copied;
+	return first + copy_from_iter(dev->buf, n - first, from);
+}
+
+/* Same as above for kernel buffers, used for record headers */
+static void scullb_peek(struct scull_device *dev, unsigned int rp, void *dst, size_t n)
+{
+	unsigned int off = scullb_pos(dev, rp);
+	size_t first = min_t(size_t, n, dev->buflen - off);
+
+	memcpy(dst, &dev->buf[off], first);
+	memcpy(dst + first, dev->buf, n - first);
+}
+
+static void scullb_poke(struct scull_device *dev, unsigned int wp, const void *src, size_t n)
+{
+	unsigned int off = scullb_pos(dev, wp);
+	size_t first = min_t(size_t, n, dev->buflen - off);
+
+	memcpy(&dev->buf[off], src, first);
+	memcpy(dev->buf, src + first, n - first);
+}
+
+/*
+ * Readers wait for rcvlowat bytes, but never for more than the read can
+ * take (cap), as sock_rcvlowat() does, and in record mode one whole
+ * record is always enough. rcvlowat is re-read on every check so
+ * SCULLB_IOC_SLOWAT reaches readers already asleep.
+ */
+static bool scullb_readable(struct scull_device *dev, unsigned int cap)
+{
+	unsigned int queued = scullb_queued(dev);
+	__u32 len;
+
+	if (queued >= min(READ_ONCE(dev->rcvlowat), cap))
+		return true;
+	if (!dev->record || queued < SCULLB_REC_HDR)
+		return false;
+	/* Writers publish whole records, the one at rp is complete if it is all queued */
+	scullb_peek(dev, scullb_rp(dev), &len, sizeof(len));
+	return len <= queued - SCULLB_REC_HDR;
+}
+
+/*
+ * Bytes, headers included, of the whole records queued at rp that a
+ * read of 'bytes' should take. A plain read takes exactly one record
+ * and fails with -EMSGSIZE if its payload doesn't fit; a batch read
+ * takes as many records as fit.
+ */
+static long scullb_record_span(struct scull_device *dev, unsigned int rp,
+			       unsigned int used, size_t bytes, bool batch)
+{
+	unsigned int span = 0;
+	unsigned int rec;
+	__u32 len;
+
+	while (span < used) {
+		if (used - span < SCULLB_REC_HDR)
+			return -EIO;
+		scullb_peek(dev, scullb_advance(dev, rp, span), &len, sizeof(len));
+		if (len > used - span - SCULLB_REC_HDR)
+			return -EIO;
+		rec = SCULLB_REC_HDR + len;
+		if (!batch)
+			return len > bytes ? -EMSGSIZE : rec;
+		if (span + rec > bytes)
+			break;
+		span += rec;
+	}
+
+	return span ? span : -EMSGSIZE;
+}
+
+/*
+ * Queue records from 'from' into 'room' bytes at *wp. A plain write is
+ * one record; a batch write stores each segment of the iterator as its
+ * own record. Empty segments are skipped. Returns payload bytes queued.
+ */
+static ssize_t scullb_put_records(struct scull_device *dev, unsigned int *wp,
+				  unsigned int room, struct iov_iter *from, bool batch)
+{
+	ssize_t written = 0;
+	__u32 len;
+
+	while (iov_iter_count(from)) {
+		len = batch ? iov_iter_single_seg_count(from) : iov_iter_count(from);
+		if (!len) {
+			iov_iter_advance(from, 0);
+			continue;
+		}
+		if (SCULLB_REC_HDR + len > room)
+			break;
+		scullb_poke(dev, *wp, &len, sizeof(len));
+		/* A partially copied record is never published */
+		if (scullb_copy_from_iter(dev, scullb_advance(dev, *wp, SCULLB_REC_HDR), len, from) != len)
+			return written ? written : -EFAULT;
+		*wp = scullb_advance(dev, *wp, SCULLB_REC_HDR + len);
+		room -= SCULLB_REC_HDR + len;
+		written += len;
+		if (!batch)
+			break;
+	}
+
+	return written;
+}
+
+/*
+ * Only take the wait queue lock if somebody is actually sleeping.
+ * wq_has_sleeper() provides the barrier pairing with prepare_to_wait().
+ */
+static inline void scullb_wake(wait_queue_head_t *wq)
+{
+	if (wq_has_sleeper(wq))
+		wake_up_interruptible(wq);
+}
+
+/* Data was added: wake readers, pollers and SIGIO listeners */
+static inline void scullb_wake_readers(struct scull_device *dev)
+{
+	scullb_wake(&dev->inq);
+	kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/* Space was freed: wake writers, pollers and SIGIO listeners */
+static inline void scullb_wake_writers(struct scull_device *dev)
+{
+	scullb_wake(&dev->outq);
+	kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
+}
+
+/*
+ * Wait, with the device unlocked, until cond(dev, arg) holds. Spins for
+ * up to spin_us first and then sleeps on wq for up to timeout_ms.
+ * Returns 0, -ETIMEDOUT or -ERESTARTSYS.
+ */
+static int scullb_wait(struct scull_device *dev, wait_queue_head_t *wq,
+		       bool (*cond)(struct scull_device *, unsigned int), unsigned int arg)
+{
+	u64 spin_ns = (u64)READ_ONCE(dev->spin_us) * NSEC_PER_USEC;
+	unsigned int tmo = READ_ONCE(dev->timeout_ms);
+	long ret;
+
+	if (spin_ns) {
+		u64 end = local_clock() + spin_ns;
+
+		do {
+			if (cond(dev, arg))
+				return 0;
+			cpu_relax();
+		} while (local_clock() < end && !need_resched() && !signal_pending(current));
+	}
+
+	if (!tmo)
+		return wait_event_interruptible(*wq, cond(dev, arg));
+
+	ret = wait_event_interruptible_timeout(*wq, cond(dev, arg), msecs_to_jiffies(tmo));
+	if (ret < 0)
+		return ret;
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * Called after wp moved to new_wp, wakes readers if rcvlowat bytes are
+ * queued, or if a reader may be satisfied with less: in record mode any
+ * record will do, and short_readers asked for less than rcvlowat. Every
+ * such write wakes, so edge triggered epoll and SIGIO see each one;
+ * wq_has_sleeper() keeps it cheap when nobody waits. rp is sampled
+ * after wp is published, so a reader that checked the queue and went
+ * to sleep before this write is always seen.
+ */
+static void scullb_wrote(struct scull_device *dev, unsigned int new_wp)
+{
+	unsigned int used;
+
+	/* Order the store of wp before the load of rp */
+	smp_mb();
+	used = scullb_used(dev, new_wp, scullb_rp(dev));
+	if (used >= READ_ONCE(dev->rcvlowat) || dev->record ||
+	    atomic_read(&dev->short_readers))
+		scullb_wake_readers(dev);
+}
+
+/* Called after rp moved to new_rp, wakes writers if sndlowat bytes are free */
+static void scullb_consumed(struct scull_device *dev, unsigned int new_rp)
+{
+	unsigned int used, space;
+
+	/* Order the store of rp before the load of wp */
+	smp_mb();
+	used = scullb_used(dev, scullb_wp(dev), new_rp);
+	space = used < dev->buflen ? dev->buflen - used : 0;
+	if (space >= READ_ONCE(dev->sndlowat))
+		scullb_wake_writers(dev);
+}
+
 /*
  * Simulates a blocking read using
- * wait queues.
+ * wait queues. 'batch' is set for readv()/read_iter callers, which in
+ * record mode get several records back to back, each with its header.
  */
-static ssize_t scullb_read(struct file *filp, char __user *ubuf, size_t bytes, loff_t *loff)
+static ssize_t __scullb_do_read(struct scull_device *dev, struct iov_iter *to,
+				bool nonblock, bool batch, u64 *wait_ns)
 {
+	size_t bytes = iov_iter_count(to);
 	int ret;
-	int bytes2read;
-	int bytesread;
-    int bytes_remaining;
-	unsigned long timeout;
+	u64 t0;
+	long span;
+	unsigned int skip;
+	unsigned int bytes2read;
+	unsigned int bytesread;
+	unsigned int wp, rp, used;
+	unsigned int cap;
+	bool short_read;
 
-	pr_info("%s entre %d\n", __func__, scullb.wp);
-	pr_info("%s entre %d\n", __func__, scullb.rp);
-
-	ret = down_interruptible(&scullb.sem);
+	ret = scullb_lock(dev);
 	if (ret < 0)
 		return ret;
-	/* Read sleeps if buffer is empty */
-	while (scullb.wp == scullb.rp) {         /* Buffer empty */
-		up(&scullb.sem);
-		if ((filp->f_flags & O_NONBLOCK) == O_NONBLOCK)
+	/* Read sleeps until rcvlowat bytes, or as many as it can take, are queued */
+	cap = clamp_t(size_t, bytes, 1, dev->buflen);
+	while (!scullb_readable(dev, cap)) {         /* Buffer empty */
+		/* Non blocking readers take whatever is there */
+		if (nonblock && !scullb_empty(dev))
+			break;
+		scullb_unlock(dev);
+		trace_scullb_ring_empty(dev->name, READ_ONCE(dev->hdr->wp), READ_ONCE(dev->hdr->rp));
+		if (nonblock)
 			return -EAGAIN;
 
-		/* Setting timeout to 10seconds, on x86 'HZ' is 100/250(?) */
-		#ifdef CONFIG_TIMEOUT
-		timeout = (HZ * 10);
-		ret = wait_event_interruptible_timeout(scullb.inq, scullb.wp != scullb.rp, timeout);
-		#else
-		ret = wait_event_interruptible(scullb.inq, scullb.wp != scullb.rp);
-		#endif
+		short_read = cap < READ_ONCE(dev->rcvlowat);
+		if (short_read) {
+			atomic_inc(&dev->short_readers);
+			/* Pairs with the barrier in scullb_wrote() */
+			smp_mb__after_atomic();
+		}
+		t0 = local_clock();
+		ret = scullb_wait(dev, &dev->inq, scullb_readable, cap);
+		*wait_ns += local_clock() - t0;
+		if (short_read)
+			atomic_dec(&dev->short_readers);
 		if (ret < 0)
 			return ret;
-		#ifdef CONFIG_TIMEOUT
-		pr_info("timeout is %lu\n", timeout);
-		#endif
         /* Obtain semaphore and fall through */
-		if (down_interruptible(&scullb.sem) < 0)
+		if (scullb_lock(dev) < 0)
 			return -ERESTARTSYS;
 	}
 
-	if (scullb.wp > scullb.rp) {
-		bytes2read = scullb.wp - scullb.rp;
-		bytes2read = (bytes2read < bytes) ? bytes2read : bytes;
-		bytes_remaining = copy_to_user(ubuf, &scullb.buf[scullb.rp], bytes2read);
-	} else {
-		bytes2read = bytes;
-		if (bytes2read > (scullb.buflen - scullb.rp)) {
-			bytes2read = scullb.buflen - scullb.rp;
-			bytes_remaining = copy_to_user(ubuf, &scullb.buf[scullb.rp], bytes2read);
-		} else {
-			bytes_remaining = copy_to_user(ubuf, &scullb.buf[scullb.rp], bytes2read);
+	/* Pairs with the release store of wp by the writer */
+	wp = scullb_wp(dev);
+	rp = scullb_rp(dev);
+	used = scullb_used(dev, wp, rp);
+	if (used > dev->buflen) {
+		/* Indices corrupted through the mapping */
+		scullb_unlock(dev);
+		return -EIO;
+	}
+
+	if (dev->record) {
+		span = scullb_record_span(dev, rp, used, bytes, batch);
+		if (span < 0) {
+			scullb_unlock(dev);
+			return span;
 		}
+		/* A plain read returns the payload without its header */
+		skip = batch ? 0 : SCULLB_REC_HDR;
+	} else {
+		/* Drain as much as is queued, across the wrap, in one call */
+		span = min_t(size_t, used, bytes);
+		skip = 0;
+	}
+	bytes2read = span - skip;
+	bytesread = scullb_copy_to_iter(dev, scullb_advance(dev, rp, skip), bytes2read, to);
+	if (bytesread < bytes2read && (dev->record || !bytesread)) {
+		/* Records are consumed whole or not at all */
+		scullb_unlock(dev);
+		return -EFAULT;
 	}
-    bytesread = bytes2read - bytes_remaining;
-	scullb.rp = (scullb.rp + bytesread) % scullb.buflen;
-	up(&scullb.sem);
+	if (!dev->record)
+		span = bytesread;
+	/* Data must be copied out before the writer can see the slot free */
+	smp_store_release(&dev->hdr->rp, scullb_advance(dev, rp, span));
+	scullb_unlock(dev);
 
     /* Wake up any blocked write operations */
-	/* I believe wakeup_interruptible can be scheduled out before call completes */
-	wake_up_interruptible(&scullb.outq);
-	pr_info("%s extre %d\n", __func__, scullb.wp);
-	pr_info("%s extre %d\n", __func__, scullb.rp);
+	scullb_consumed(dev, scullb_advance(dev, rp, span));
 	return bytesread;
 }
 
-static ssize_t scullb_write(struct file *filp, const char __user *ubuf, size_t bytes, loff_t *loff)
+static ssize_t __scullb_do_write(struct scull_device *dev, struct iov_iter *from,
+				 bool nonblock, bool batch, u64 *wait_ns)
 {
+	size_t bytes = iov_iter_count(from);
 	int ret;
-	int bytes2write;
-	int byteswritten;
-	int bytes_remaining;
-	unsigned long timeout;
+	u64 t0;
+	ssize_t byteswritten;
+	unsigned int need;
+	unsigned int wp, rp, used;
 
-	timeout = HZ * 10;
-	pr_info("%s entre %d\n", __func__, scullb.wp);
-	pr_info("%s entre %d\n", __func__, scullb.rp);
+	if (!bytes)
+		return 0;
+	/* Space that has to be free before anything can be queued */
+	need = 1;
+	if (dev->record) {
+		size_t len = batch ? iov_iter_single_seg_count(from) : bytes;
 
-	ret = down_interruptible(&scullb.sem);
+		if (len + SCULLB_REC_HDR > dev->buflen)
+			return -EMSGSIZE;
+		need = len + SCULLB_REC_HDR;
+	}
+
+	ret = scullb_lock(dev);
 	if (ret < 0)
 		return ret;
-	/* Add write op to waitqueue and sleep if buffer is full */	
-	while ((scullb.wp + 1) % scullb.buflen == scullb.rp) {             /* Buffer full */
-		up(&scullb.sem);
+	/* Add write op to waitqueue and sleep if buffer is full */
+	while (!scullb_writable(dev, need)) {             /* Buffer full */
+		/* Non blocking writers don't wait for sndlowat */
+		if (nonblock && scullb_space(dev) >= need)
+			break;
+		scullb_unlock(dev);
+		trace_scullb_ring_full(dev->name, READ_ONCE(dev->hdr->wp), READ_ONCE(dev->hdr->rp));
         /* Check if NONBLOCK flag is set */
-		if ((filp->f_flags & O_NONBLOCK) == O_NONBLOCK)
+		if (nonblock)
 			return -EAGAIN;
 
-		#ifdef CONFIG_TIMEOUT
-		ret = wait_event_interruptible_timeout(scullb.outq, ((scullb.wp + 1) % scullb.buflen) != scullb.rp, timeout);
-		#else
-		ret = wait_event_interruptible(scullb.outq, ((scullb.wp + 1) % scullb.buflen) != scullb.rp);
-		#endif
+		t0 = local_clock();
+		ret = scullb_wait(dev, &dev->outq, scullb_writable, need);
+		*wait_ns += local_clock() - t0;
 		if (ret < 0)
 			return ret;
         /* Acquire semaphore and fall through */
-		if (down_interruptible(&scullb.sem) < 0)
+		if (scullb_lock(dev) < 0)
 			return -ERESTARTSYS;
 	}
-	
-	/* Find the correct size dependent on bytes, rp and wp, end of buffer */
-	if (scullb.wp  < scullb.rp) {
-		bytes2write = scullb.rp - scullb.wp - 1;
-		bytes2write = (bytes2write < bytes) ? bytes2write : bytes;
-		bytes_remaining = copy_from_user(&scullb.buf[scullb.wp], ubuf, bytes2write);
 
+	/* Pairs with the release store of rp by the reader */
+	rp = scullb_rp(dev);
+	wp = scullb_wp(dev);
+	used = scullb_used(dev, wp, rp);
+	if (used > dev->buflen) {
+		scullb_unlock(dev);
+		return -EIO;
+	}
+
+	if (dev->record) {
+		byteswritten = scullb_put_records(dev, &wp, dev->buflen - used, from, batch);
 	} else {
-		bytes2write = bytes;
-		if (bytes2write > (scullb.buflen - scullb.wp)) {
-			bytes2write = scullb.buflen - scullb.wp - 1;
-			bytes_remaining = copy_from_user(&scullb.buf[scullb.wp], ubuf, bytes2write);
-		} else {
-			bytes_remaining = copy_from_user(&scullb.buf[scullb.wp], ubuf, bytes2write);
-		}
+		/* Fill all free space, across the wrap, in one call */
+		byteswritten = scullb_copy_from_iter(dev, wp, min_t(size_t, dev->buflen - used, bytes), from);
+		if (!byteswritten)
+			byteswritten = -EFAULT;
+		else
+			wp = scullb_advance(dev, wp, byteswritten);
 	}
-    byteswritten = bytes2write - bytes_remaining;
-	scullb.wp = (scullb.wp + byteswritten) % scullb.buflen;
-	up(&scullb.sem);
+	if (byteswritten <= 0) {
+		scullb_unlock(dev);
+		return byteswritten ? byteswritten : -EFAULT;
+	}
+	/* Publish the data before the new write pointer */
+	smp_store_release(&dev->hdr->wp, wp);
+	scullb_unlock(dev);
 
     /* Wake up any blocked read operations */
-	wake_up_interruptible(&scullb.inq);
-	pr_info("%s extre %d\n", __func__, scullb.wp);
-	pr_info("%s extre %d\n", __func__, scullb.rp);
+	scullb_wrote(dev, wp);
 	return byteswritten;
 }
 
+/* Fold one transfer into this cpu's counters */
+static void scullb_account(struct scull_device *dev, bool write, ssize_t ret, u64 wait_ns)
+{
+	unsigned int bucket;
+
+	if (wait_ns)
+		this_cpu_add(dev->stats->blocked_ns, wait_ns);
+	if (ret == -EAGAIN)
+		this_cpu_inc(dev->stats->eagain);
+	if (ret < 0)
+		return;
+
+	if (write) {
+		this_cpu_inc(dev->stats->wr_ops);
+		this_cpu_add(dev->stats->wr_bytes, ret);
+	} else {
+		this_cpu_inc(dev->stats->rd_ops);
+		this_cpu_add(dev->stats->rd_bytes, ret);
+	}
+	bucket = div_u64((u64)min(scullb_queued(dev), dev->buflen) * SCULLB_OCC_BUCKETS, dev->buflen);
+	this_cpu_inc(dev->stats->occupancy[min(bucket, SCULLB_OCC_BUCKETS - 1U)]);
+}
+
+static ssize_t scullb_do_read(struct file *filp, struct iov_iter *to, bool nonblock, bool batch)
+{
+	struct scull_device *dev = scullb_dev(filp);
+	u64 wait_ns = 0;
+	ssize_t ret;
+
+	trace_scullb_op_enter(dev->name, false, iov_iter_count(to));
+	ret = __scullb_do_read(dev, to, nonblock, batch, &wait_ns);
+	scullb_account(dev, false, ret, wait_ns);
+	trace_scullb_op_exit(dev->name, false, ret, wait_ns);
+	return ret;
+}
+
+static ssize_t scullb_do_write(struct file *filp, struct iov_iter *from, bool nonblock, bool batch)
+{
+	struct scull_device *dev = scullb_dev(filp);
+	u64 wait_ns = 0;
+	ssize_t ret;
+
+	trace_scullb_op_enter(dev->name, true, iov_iter_count(from));
+	ret = __scullb_do_write(dev, from, nonblock, batch, &wait_ns);
+	scullb_account(dev, true, ret, wait_ns);
+	trace_scullb_op_exit(dev->name, true, ret, wait_ns);
+	return ret;
+}
+
+static ssize_t scullb_read(struct file *filp, char __user *ubuf, size_t bytes, loff_t *loff)
+{
+	struct iovec iov;
+	struct iov_iter to;
+	int ret;
+
+	ret = import_single_range(READ, ubuf, bytes, &iov, &to);
+	if (ret < 0)
+		return ret;
+	return scullb_do_read(filp, &to, (filp->f_flags & O_NONBLOCK) == O_NONBLOCK, false);
+}
+
+static ssize_t scullb_write(struct file *filp, const char __user *ubuf, size_t bytes, loff_t *loff)
+{
+	struct iovec iov;
+	struct iov_iter from;
+	int ret;
+
+	ret = import_single_range(WRITE, (char __user *)ubuf, bytes, &iov, &from);
+	if (ret < 0)
+		return ret;
+	return scullb_do_write(filp, &from, (filp->f_flags & O_NONBLOCK) == O_NONBLOCK, false);
+}
+
+/* readv()/writev() and aio, moving many records per call in record mode */
+static ssize_t scullb_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	bool nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+
+	return scullb_do_read(filp, to, nonblock, true);
+}
+
+static ssize_t scullb_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	bool nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+
+	return scullb_do_write(filp, from, nonblock, true);
+}
+
+/*
+ * Doorbells for producers and consumers working through the mapping.
+ * Userspace only needs to ring them when it takes the ring from empty to
+ * non-empty or from full to non-full.
+ */
+static long scullb_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_device *dev = scullb_dev(filp);
+	struct scullb_lowat lowat;
+	struct scullb_wait wait;
+
+	switch (cmd) {
+	case SCULLB_IOC_PRODUCED:
+		scullb_wake_readers(dev);
+		break;
+
+	case SCULLB_IOC_CONSUMED:
+		scullb_wake_writers(dev);
+		break;
+
+	case SCULLB_IOC_GSIZE:
+		return put_user((__u64)dev->buflen, (__u64 __user *)arg);
+
+	case SCULLB_IOC_SLOWAT:
+		if (copy_from_user(&lowat, (void __user *)arg, sizeof(lowat)))
+			return -EFAULT;
+		WRITE_ONCE(dev->rcvlowat, clamp(lowat.rcvlowat, 1U, dev->buflen));
+		WRITE_ONCE(dev->sndlowat, clamp(lowat.sndlowat, 1U, dev->buflen));
+		/* Sleepers re-read the thresholds in their wait condition */
+		wake_up_interruptible(&dev->inq);
+		wake_up_interruptible(&dev->outq);
+		break;
+
+	case SCULLB_IOC_GLOWAT:
+		lowat.rcvlowat = READ_ONCE(dev->rcvlowat);
+		lowat.sndlowat = READ_ONCE(dev->sndlowat);
+		if (copy_to_user((void __user *)arg, &lowat, sizeof(lowat)))
+			return -EFAULT;
+		break;
+
+	case SCULLB_IOC_SWAIT:
+		if (copy_from_user(&wait, (void __user *)arg, sizeof(wait)))
+			return -EFAULT;
+		WRITE_ONCE(dev->spin_us, wait.spin_us);
+		WRITE_ONCE(dev->timeout_ms, wait.timeout_ms);
+		break;
+
+	case SCULLB_IOC_GWAIT:
+		wait.spin_us = READ_ONCE(dev->spin_us);
+		wait.timeout_ms = READ_ONCE(dev->timeout_ms);
+		if (copy_to_user((void __user *)arg, &wait, sizeof(wait)))
+			return -EFAULT;
+		break;
+
+	default:
+		return -ENOTTY;
+	}
+
+	return 0;
+}
+
+/* Maps the header page followed by the data pages */
+static int scullb_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_device *dev = scullb_dev(filp);
+	unsigned long pages = vma_pages(vma);
+	unsigned long pfn;
+
+	if (!dev->contig)
+		return remap_vmalloc_range(vma, dev->hdr, vma->vm_pgoff);
+
+	if (vma->vm_pgoff + pages > (dev->mapsize >> PAGE_SHIFT))
+		return -EINVAL;
+	pfn = (virt_to_phys(dev->hdr) >> PAGE_SHIFT) + vma->vm_pgoff;
+	return remap_pfn_range(vma, vma->vm_start, pfn, pages << PAGE_SHIFT, vma->vm_page_prot);
+}
+
+/*
+ * Readable once rcvlowat bytes, or in record mode a whole record, are
+ * queued, writable once sndlowat bytes are free.
+ * Every write that leaves rcvlowat bytes queued wakes readers, and every
+ * read that leaves sndlowat bytes free wakes writers, which is what edge
+ * triggered epoll needs to see each new event.
+ */
+static __poll_t scullb_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_device *dev = scullb_dev(filp);
+	__poll_t mask = 0;
+	unsigned int used;
+
+	poll_wait(filp, &dev->inq, wait);
+	poll_wait(filp, &dev->outq, wait);
+	/* Pairs with the barrier in wq_has_sleeper() on the waker side */
+	smp_mb();
+
+	used = scullb_used(dev, scullb_wp(dev), scullb_rp(dev));
+	if (used > dev->buflen)
+		return EPOLLERR;
+	if (scullb_readable(dev, dev->buflen))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (dev->buflen - used >= READ_ONCE(dev->sndlowat))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static int scullb_fasync(int fd, struct file *filp, int mode)
+{
+	struct scull_device *dev = scullb_dev(filp);
+
+	return fasync_helper(fd, filp, mode, &dev->async_queue);
+}
+
 static int scullb_close(struct inode *inode, struct file *filp)
 {
-	pr_info("scullb close\n");
+	/* Remove this filp from the asynchronously notified filp's */
+	scullb_fasync(-1, filp, 0);
+	pr_info("%s close\n", scullb_dev(filp)->name);
 	return 0;
 }
 
 static const struct file_operations scullb_fops = {
+	.owner = THIS_MODULE,
 	.read = scullb_read,
 	.write = scullb_write,
+	.read_iter = scullb_read_iter,
+	.write_iter = scullb_write_iter,
+	/* Pipe pages are filled straight from the ring, no user bounce */
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = scullb_ioctl,
+	.mmap = scullb_mmap,
+	.poll = scullb_poll,
+	.fasync = scullb_fasync,
 	.release = scullb_close
 };
 
-static int __init init_world(void)
+static int scullb_stats_show(struct seq_file *m, void *v)
+{
+	struct scull_device *dev = m->private;
+	struct scullb_stats sum = { 0 };
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct scullb_stats *st = per_cpu_ptr(dev->stats, cpu);
+
+		sum.rd_ops += st->rd_ops;
+		sum.wr_ops += st->wr_ops;
+		sum.rd_bytes += st->rd_bytes;
+		sum.wr_bytes += st->wr_bytes;
+		sum.blocked_ns += st->blocked_ns;
+		sum.eagain += st->eagain;
+		for (i = 0; i < SCULLB_OCC_BUCKETS; i++)
+			sum.occupancy[i] += st->occupancy[i];
+	}
+
+	seq_printf(m, "rd_ops %llu\nwr_ops %llu\n", sum.rd_ops, sum.wr_ops);
+	seq_printf(m, "rd_bytes %llu\nwr_bytes %llu\n", sum.rd_bytes, sum.wr_bytes);
+	seq_printf(m, "blocked_ns %llu\neagain %llu\n", sum.blocked_ns, sum.eagain);
+	seq_puts(m, "occupancy");
+	for (i = 0; i < SCULLB_OCC_BUCKETS; i++)
+		seq_printf(m, " %llu", sum.occupancy[i]);
+	seq_putc(m, '\n');
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scullb_stats);
+
+/*
+ * The ring is one header page followed by the data pages. Rings up to
+ * the largest buddy allocation are taken physically contiguous from the
+ * device's node: the kernel then copies through the linear map, which
+ * is mapped with huge pages, instead of through 4K vmalloc mappings.
+ * Larger rings, or a fragmented node, fall back to vmalloc.
+ */
+static int scullb_alloc_ring(struct scull_device *dev)
 {
+	dev->mapsize = PAGE_SIZE + PAGE_ALIGN(dev->buflen);
+
+	if (get_order(dev->mapsize) < MAX_ORDER) {
+		dev->hdr = alloc_pages_exact_nid(dev->node, dev->mapsize,
+						 GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY);
+		if (dev->hdr) {
+			dev->contig = true;
+			return 0;
+		}
+	}
+
+	/* vmalloc_user() zeroes the ring as well */
+	dev->hdr = vmalloc_user(dev->mapsize);
+	if (!dev->hdr)
+		return -ENOMEM;
+	dev->contig = false;
+	return 0;
+}
+
+static void scullb_free_ring(struct scull_device *dev)
+{
+	if (dev->contig)
+		free_pages_exact(dev->hdr, dev->mapsize);
+	else
+		vfree(dev->hdr);
+}
+
+/* Allocate and register one ring device */
+static int scullb_create(unsigned int index)
+{
+	struct scull_device *dev;
+	int node = NUMA_NO_NODE;
 	int ret;
 
-	pr_info("init sleep driver\n");
-    /* Register 2 blocking queues for input and output */
-	init_waitqueue_head(&scullb.inq);
-	init_waitqueue_head(&scullb.outq);
+	/* Keep the device on the node of the cpu it is meant to serve */
+	if (index < nr_cpu_ids && cpu_possible(index))
+		node = cpu_to_node(index);
 
-	scullb.buflen = buflen;
-	/* Request memory for circ buffer */
-	scullb.buf = kmalloc_array(buflen, sizeof(char *), GFP_KERNEL);
-	if (!scullb.buf)
+	dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+	if (!dev)
 		return -ENOMEM;
+	dev->node = node;
 
-	/* Print the size of memory block allocated by kmalloc from slab cache */
-	pr_info("size allocated for buffer %lu\n", ksize(scullb.buf));
-	scullb.wp = 0;
-	scullb.rp = scullb.wp;
+    /* Register 2 blocking queues for input and output */
+	init_waitqueue_head(&dev->inq);
+	init_waitqueue_head(&dev->outq);
+
+	dev->buflen = buflen;
+	/* Request memory for circ buffer, zeroed so wp and rp start at 0 */
+	ret = scullb_alloc_ring(dev);
+	if (ret < 0)
+		goto alloc_err;
+	dev->buf = (char *)dev->hdr + PAGE_SIZE;
+	dev->hdr->size = buflen;
+	dev->hdr->data_off = PAGE_SIZE;
+	dev->record = record;
+	dev->rcvlowat = clamp(rcvlowat, 1U, dev->buflen);
+	dev->sndlowat = clamp(sndlowat, 1U, dev->buflen);
+	dev->spin_us = spin_us;
+	dev->timeout_ms = timeout_ms;
+	if (dev->record)
+		dev->hdr->flags |= SCULLB_RING_RECORD;
+
+	dev->stats = alloc_percpu(struct scullb_stats);
+	if (!dev->stats) {
+		ret = -ENOMEM;
+		goto stats_err;
+	}
 
 	/* Initialize Semaphore */
-	sema_init(&scullb.sem, 1);
+	sema_init(&dev->sem, 1);
+	dev->spsc = spsc;
 
 	/* Register char device as misc device */
-	scullb.miscd.name = "chsleep1";
-	scullb.miscd.minor = MISC_DYNAMIC_MINOR;
-	scullb.miscd.fops = &scullb_fops;
-	ret = misc_register(&scullb.miscd);
+	snprintf(dev->name, sizeof(dev->name), "chsleep%u", index + 1);
+	dev->miscd.name = dev->name;
+	dev->miscd.minor = MISC_DYNAMIC_MINOR;
+	dev->miscd.fops = &scullb_fops;
+	ret = misc_register(&dev->miscd);
 	if (ret < 0)
 		goto register_err;
+	debugfs_create_file(dev->name, 0444, scullb_debugfs, dev, &scullb_stats_fops);
 
+	pr_info("%s: %u byte ring, %s\n", dev->name, dev->buflen,
+		dev->contig ? "contiguous" : "vmalloc");
+	if (dev->spsc)
+		pr_info("%s in lockless spsc mode\n", dev->name);
+	scullb_devs[index] = dev;
 	return 0;
 
 register_err:
-    kfree(scullb.buf);
-    return -1
+	free_percpu(dev->stats);
+stats_err:
+	scullb_free_ring(dev);
+alloc_err:
+	kfree(dev);
+	return ret;
+}
+
+static void scullb_destroy(struct scull_device *dev)
+{
+	misc_deregister(&dev->miscd);
+	free_percpu(dev->stats);
+	scullb_free_ring(dev);
+	kfree(dev);
+}
+
+static int __init init_world(void)
+{
+	unsigned int i;
+	int ret;
+
+	pr_info("init sleep driver\n");
+
+	if (!ndevs)
+		return -EINVAL;
+
+	scullb_devs = kcalloc(ndevs, sizeof(*scullb_devs), GFP_KERNEL);
+	if (!scullb_devs)
+		return -ENOMEM;
+	scullb_debugfs = debugfs_create_dir("chsleep", NULL);
+
+	for (i = 0; i < ndevs; i++) {
+		ret = scullb_create(i);
+		if (ret < 0)
+			goto create_err;
+	}
+
+	return 0;
+
+create_err:
+	while (i--)
+		scullb_destroy(scullb_devs[i]);
+	debugfs_remove_recursive(scullb_debugfs);
+	kfree(scullb_devs);
+	return ret;
 }
 
 static void __exit exit_world(void)
 {
+	unsigned int i;
+
 	pr_info("Goodbye world");
-	misc_deregister(&scullb.miscd);
-	kfree(scullb.buf);
+	debugfs_remove_recursive(scullb_debugfs);
+	for (i = 0; i < ndevs; i++)
+		scullb_destroy(scullb_devs[i]);
+	kfree(scullb_devs);
 }
 
 module_init(init_world);
@@ -0,0 +1,58 @@
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#define SCULLB_IOC_MAGIC 0xb3
+
+/*
+ * mmap() of /dev/chsleep1 returns the header page followed by the ring
+ * data, which starts data_off bytes into the mapping.
+ *
+ * wp and rp run over [0, 2 * size), the byte an index refers to is
+ * data[idx % size] and the ring is full when wp - rp == size. The
+ * producer fills data and then publishes wp with a release store, the
+ * consumer drains data and then publishes rp with a release store. Each
+ * side reads the other's index with an acquire load. read() and write()
+ * use the same indices, so mapped and syscall users can be mixed.
+ *
+ * If SCULLB_RING_RECORD is set in flags the ring holds records rather
+ * than a byte stream: a native endian __u32 payload length followed by
+ * the payload, both of which may wrap. Records are published whole.
+ * write() queues one record and read() returns one record's payload,
+ * failing with EMSGSIZE if the buffer is too small. writev() queues one
+ * record per iovec; readv() returns as many whole records as fit, each
+ * still prefixed by its length.
+ */
+struct scullb_ring_hdr {
+	__u32 wp;
+	__u8 pad_wp[60];
+	__u32 rp;
+	__u8 pad_rp[60];
+	__u32 size;
+	__u32 data_off;
+	__u32 flags;
+};
+
+#define SCULLB_RING_RECORD 0x1
+#define SCULLB_REC_HDR sizeof(__u32)
+
+/*Doorbells for mmap users, only needed on empty->non-empty and full->non-full */
+#define SCULLB_IOC_PRODUCED _IO(SCULLB_IOC_MAGIC, 1) //wakes blocked readers
+#define SCULLB_IOC_CONSUMED _IO(SCULLB_IOC_MAGIC, 2) //wakes blocked writers
+
+/* Wake thresholds in bytes, clamped to [1, size] */
+struct scullb_lowat {
+	__u32 rcvlowat;
+	__u32 sndlowat;
+};
+
+/* Blocking behaviour: busy poll window, then sleep limit (0 = forever) */
+struct scullb_wait {
+	__u32 spin_us;
+	__u32 timeout_ms;
+};
+
+/*Pointer operations */
+#define SCULLB_IOC_GSIZE _IOR(SCULLB_IOC_MAGIC, 3, __u64) //ring size in bytes
+#define SCULLB_IOC_SLOWAT _IOW(SCULLB_IOC_MAGIC, 4, struct scullb_lowat)
+#define SCULLB_IOC_GLOWAT _IOR(SCULLB_IOC_MAGIC, 5, struct scullb_lowat)
+#define SCULLB_IOC_SWAIT _IOW(SCULLB_IOC_MAGIC, 6, struct scullb_wait)
+#define SCULLB_IOC_GWAIT _IOR(SCULLB_IOC_MAGIC, 7, struct scullb_wait)
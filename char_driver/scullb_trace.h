@@ -0,0 +1,79 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scullb
+
+#if !defined(_SCULLB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULLB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Start of a read or write, bytes is what the caller asked for */
+TRACE_EVENT(scullb_op_enter,
+	TP_PROTO(const char *name, bool write, size_t bytes),
+	TP_ARGS(name, write, bytes),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(bool, write)
+		__field(size_t, bytes)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->write = write;
+		__entry->bytes = bytes;
+	),
+	TP_printk("%s %s bytes=%zu", __get_str(name),
+		  __entry->write ? "write" : "read", __entry->bytes)
+);
+
+/* End of a read or write, with the time spent waiting for the other side */
+TRACE_EVENT(scullb_op_exit,
+	TP_PROTO(const char *name, bool write, ssize_t ret, u64 wait_ns),
+	TP_ARGS(name, write, ret, wait_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(bool, write)
+		__field(ssize_t, ret)
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->write = write;
+		__entry->ret = ret;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("%s %s ret=%zd wait_ns=%llu", __get_str(name),
+		  __entry->write ? "write" : "read", __entry->ret, __entry->wait_ns)
+);
+
+/* A reader found the ring empty or a writer found it full */
+DECLARE_EVENT_CLASS(scullb_ring_state,
+	TP_PROTO(const char *name, unsigned int wp, unsigned int rp),
+	TP_ARGS(name, wp, rp),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, wp)
+		__field(unsigned int, rp)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->wp = wp;
+		__entry->rp = rp;
+	),
+	TP_printk("%s wp=%u rp=%u", __get_str(name), __entry->wp, __entry->rp)
+);
+
+DEFINE_EVENT(scullb_ring_state, scullb_ring_empty,
+	TP_PROTO(const char *name, unsigned int wp, unsigned int rp),
+	TP_ARGS(name, wp, rp)
+);
+
+DEFINE_EVENT(scullb_ring_state, scullb_ring_full,
+	TP_PROTO(const char *name, unsigned int wp, unsigned int rp),
+	TP_ARGS(name, wp, rp)
+);
+
+#endif /* _SCULLB_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE scullb_trace
+#include <trace/define_trace.h>
@@ -1,6 +1,35 @@
 #include <linux/ioctl.h>
+#include <linux/types.h>
 #define SCULL_IOC_MAGIC 0xb2
 
+/* Bumped whenever a command below changes meaning, see SCULL_IOC_VERSION */
+#define SCULL_IOC_VERSION_NR 1
+
+struct scull_geometry {
+	__u32 qset;		/* blocks per quantum set */
+	__u32 block_size;	/* bytes, a power of two multiple of the page size */
+};
+
+struct scull_stats {
+	__u64 size;		/* logical size in bytes */
+	__u64 qsets;		/* quantum sets in the map */
+	__u64 blocks;		/* blocks in the map */
+	__u64 pool_blocks;	/* freed blocks cached for reuse */
+	__u64 page_allocs;	/* blocks that came from the page allocator */
+	__u64 pool_hits;	/* blocks that came from the pool */
+	__u32 block_size;
+	__u32 qset;
+};
+
 /*Non pointer operations */
 #define SCULL_IOC_QQUANTA _IO(SCULL_IOC_MAGIC, 1) //quanta is returned as return value
-#define SCULL_IOC_TQUANTA _IO(SCULL_IOC_MAGIC, 2) //quanta is obtained as arg parameter
+#define SCULL_IOC_TQUANTA _IO(SCULL_IOC_MAGIC, 2) //block size in bytes is obtained as arg parameter, a power of two multiple of the page size
+#define SCULL_IOC_VERSION _IO(SCULL_IOC_MAGIC, 4) //SCULL_IOC_VERSION_NR is returned as return value
+
+/*Pointer operations */
+#define SCULL_IOC_PREALLOC _IOW(SCULL_IOC_MAGIC, 3, __u64) //back the first n bytes with blocks up front
+#define SCULL_IOC_GSIZE _IOR(SCULL_IOC_MAGIC, 5, __u64) //logical size in bytes
+#define SCULL_IOC_SGEOMETRY _IOW(SCULL_IOC_MAGIC, 6, struct scull_geometry) //only while empty, 0 keeps a field as is
+#define SCULL_IOC_GGEOMETRY _IOR(SCULL_IOC_MAGIC, 7, struct scull_geometry)
+#define SCULL_IOC_TRUNCATE _IOW(SCULL_IOC_MAGIC, 8, __u64) //set the size without reopening, frees blocks past it
+#define SCULL_IOC_GSTATS _IOR(SCULL_IOC_MAGIC, 9, struct scull_stats)
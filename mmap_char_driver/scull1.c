@@ -7,71 +7,311 @@
 #include <linux/cdev.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
-#include <linux/semaphore.h>
+#include <linux/rwsem.h>
+#include <linux/atomic.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
+#include <linux/xarray.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/sched/signal.h>
 #include "scull.h"
 
-#define MAX_DEVICE 1
 #define QLEN 1000
-#define BLOCK_LEN 4000
+#define QLEN_MAX 65536
 
 MODULE_LICENSE("GPL");
 
+/* Number of minors, each an independent store */
+static int ndevs = 4;
+module_param(ndevs, int, 0444);
+MODULE_PARM_DESC(ndevs, "Number of scull devices");
+
+/* Freed blocks kept per device for reuse instead of going back to the page allocator */
+static int pool_blocks = 256;
+module_param(pool_blocks, int, 0644);
+MODULE_PARM_DESC(pool_blocks, "Freed blocks cached per device");
+
+/* Blocks are 2^block_order pages */
+static unsigned int block_order;
+module_param(block_order, uint, 0444);
+MODULE_PARM_DESC(block_order, "Default block size as a page order");
+
 dev_t scull_id;
 int major;
 int minor;
-struct qset *curset;
 
+/*
+ * rwsem protects the block map: qsets, every qset->data[], the pool and
+ * block_order. Readers and writers that only copy into blocks that
+ * already exist take it shared, anything that allocates or frees blocks
+ * takes it exclusive. size only grows under the shared lock, so it is an
+ * atomic maximum.
+ */
 struct scull_device {
-	struct qset *qset_hd;
+	/* Quantum number -> struct qset, O(1) lookup from a file offset */
+	struct xarray qsets;
 	int qset_len;
-	int used_qblk;
-	int datalen;
-	struct semaphore sem;
-	struct cdev chardev;
-} scull_dev;
-
-/* A block of memory consisting of QLEN blocks
-   of BLOCK_LEN each
+	/* End of the furthest write */
+	atomic64_t size;
+	/* Free blocks, linked through their first word */
+	void *pool;
+	int pool_len;
+	/* Every block is PAGE_SIZE << block_order bytes, page aligned */
+	unsigned int block_order;
+	/* Blocks per quantum set */
+	int qlen;
+	/* Blocks currently in the map, and where new ones came from */
+	unsigned long nr_blocks;
+	u64 page_allocs;
+	u64 pool_hits;
+	/* Device node inode whose mapping every open shares, see scull_open() */
+	struct inode *inode;
+	struct rw_semaphore rwsem;
+};
+
+/* One cdev covers minors [minor, minor + ndevs) */
+static struct cdev scull_cdev;
+static struct scull_device *scull_devs;
+
+/* A block of memory consisting of qlen blocks
+   of scull_block_len() each
    data[0] - Block 0
    data[1] - Block 1
+   Quantum n covers offsets [n * quanta, (n + 1) * quanta)
+   Blocks are allocated on first write, untouched ones stay NULL
+   and read back as zeroes.
  */
 struct qset {
 	void **data;
-	struct qset *next;
 };
 
+static inline size_t scull_block_len(struct scull_device *sculld)
+{
+	return PAGE_SIZE << sculld->block_order;
+}
+
+static inline u32 scull_quanta(struct scull_device *sculld)
+{
+	return sculld->qlen * scull_block_len(sculld);
+}
+
+static inline loff_t scull_size(struct scull_device *sculld)
+{
+	return atomic64_read(&sculld->size);
+}
+
+/* Move the end of the device out to pos, if it isn't already past it */
+static void scull_extend(struct scull_device *sculld, loff_t pos)
+{
+	s64 old = atomic64_read(&sculld->size);
+	s64 cur;
+
+	while (pos > old) {
+		cur = atomic64_cmpxchg(&sculld->size, old, pos);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+/*
+ * Blocks come straight from the page allocator as compound pages, so
+ * each one is naturally aligned and can later be handed to the mm
+ * page by page.
+ */
+static void *scull_get_block(struct scull_device *sculld)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+
+	if (sculld->block_order)
+		gfp |= __GFP_COMP;
+	return (void *)__get_free_pages(gfp, sculld->block_order);
+}
+
+static void scull_put_block(struct scull_device *sculld, void *block)
+{
+	free_pages((unsigned long)block, sculld->block_order);
+}
+
+/* Returns a zeroed block, from the pool if possible */
+static void *scull_alloc_block(struct scull_device *sculld)
+{
+	void *block = sculld->pool;
+
+	if (!block) {
+		block = scull_get_block(sculld);
+		if (!block)
+			return NULL;
+		sculld->page_allocs++;
+		sculld->nr_blocks++;
+		return block;
+	}
+
+	sculld->pool = *(void **)block;
+	sculld->pool_len--;
+	sculld->pool_hits++;
+	sculld->nr_blocks++;
+	memset(block, 0, scull_block_len(sculld));
+	return block;
+}
+
+static void scull_free_block(struct scull_device *sculld, void *block)
+{
+	if (!block)
+		return;
+	sculld->nr_blocks--;
+	/* Still mapped by someone, the last put_page() frees it */
+	if (sculld->pool_len >= READ_ONCE(pool_blocks) ||
+	    page_ref_count(virt_to_head_page(block)) != 1) {
+		scull_put_block(sculld, block);
+		return;
+	}
+	*(void **)block = sculld->pool;
+	sculld->pool = block;
+	sculld->pool_len++;
+}
+
+static void scull_drain_pool(struct scull_device *sculld)
+{
+	void *block;
+
+	while ((block = sculld->pool)) {
+		sculld->pool = *(void **)block;
+		scull_put_block(sculld, block);
+	}
+	sculld->pool_len = 0;
+}
+
+/* Geometry can only change while the device holds no data */
+static int scull_set_geometry(struct scull_device *sculld, unsigned long qlen,
+			      unsigned long len)
+{
+	unsigned int order;
+
+	if (!qlen || qlen > QLEN_MAX)
+		return -EINVAL;
+	if (len < PAGE_SIZE || !is_power_of_2(len))
+		return -EINVAL;
+	order = ilog2(len) - PAGE_SHIFT;
+	if (order >= MAX_ORDER || (u64)qlen * len > U32_MAX)
+		return -EINVAL;
+	if (sculld->qset_len)
+		return -EBUSY;
+
+	/* Pooled blocks are the old size */
+	if (order != sculld->block_order)
+		scull_drain_pool(sculld);
+	sculld->block_order = order;
+	sculld->qlen = qlen;
+	return 0;
+}
+
+static void free_qset(struct scull_device *sculld, struct qset *qset)
+{
+	int i;
+
+	for (i = 0; i < sculld->qlen; i++)
+		scull_free_block(sculld, qset->data[i]);
+	kfree(qset->data);
+	kfree(qset);
+}
+
+/*
+ * Zap user mappings of [from, end). Freed blocks that are still mapped
+ * only leave the pool, so without this a MAP_SHARED user would keep
+ * reading and writing pages the device no longer owns. Like
+ * truncate_pagecache(), private COW copies go too. Called with
+ * sculld->rwsem held for write, so nothing can fault them back in
+ * before the blocks are gone.
+ */
+static void scull_unmap(struct scull_device *sculld, loff_t from)
+{
+	struct inode *inode = READ_ONCE(sculld->inode);
+
+	if (inode)
+		unmap_mapping_range(inode->i_mapping, round_up(from, PAGE_SIZE), 0, 1);
+}
+
 static int scull_trunc(struct scull_device *sculld)
 {
-	struct qset *qset, *next;
+	struct qset *qset;
+	unsigned long q;
+
+	scull_unmap(sculld, 0);
 	//Clear all quantum sets.
-	for (qset = sculld->qset_hd; qset != NULL; qset = next) {
-		next = qset;
-		if (qset->data != NULL) {
-			int i = 0;
-
-			for (i = 0; i < sculld->used_qblk; i++) { /*TODO: sculld->datalen has to be modified for multiple quantas */
-				/*unlikely is a macro defined in kernel headers */
-				if (unlikely(!qset->data[i])) {
-					pr_info("Trying to free uninitialized block\n");
-					return -1;
-				}
-
-				kfree(qset->data[i]);
-			}
-			kfree(qset->data);
-			next = qset->next;
-			kfree(qset);
-		} else {
-			kfree(qset);
-			break;
+	xa_for_each(&sculld->qsets, q, qset)
+		free_qset(sculld, qset);
+	xa_destroy(&sculld->qsets);
+	sculld->qset_len = 0;
+	atomic64_set(&sculld->size, 0);
+	return 0;
+}
+
+/*
+ * Set the size to len. Blocks wholly past the new end are freed and the
+ * tail of the block it falls in is zeroed, so growing again later reads
+ * back zeroes. Growing just leaves a hole. Called with sculld->rwsem
+ * held for write.
+ */
+static int scull_truncate(struct scull_device *sculld, loff_t len)
+{
+	size_t block_len = scull_block_len(sculld);
+	struct qset *qset;
+	unsigned long first;
+	unsigned long q;
+	u32 rem;
+	int off;
+	int i;
+
+	if (len < 0)
+		return -EINVAL;
+	if (!len)
+		return scull_trunc(sculld);
+
+	scull_unmap(sculld, len);
+	first = div_u64_rem(len, scull_quanta(sculld), &rem);
+	xa_for_each(&sculld->qsets, q, qset) {
+		if (q < first)
+			continue;
+		if (q > first || !rem) {
+			xa_erase(&sculld->qsets, q);
+			free_qset(sculld, qset);
+			sculld->qset_len--;
+			continue;
+		}
+
+		i = rem / block_len;
+		off = rem % block_len;
+		if (off && qset->data[i]) {
+			memset(qset->data[i] + off, 0, block_len - off);
+			i++;
+		}
+		for (; i < sculld->qlen; i++) {
+			scull_free_block(sculld, qset->data[i]);
+			qset->data[i] = NULL;
 		}
 	}
-	sculld->qset_hd = NULL;
+	atomic64_set(&sculld->size, len);
 	return 0;
 }
 
+static void scull_get_stats(struct scull_device *sculld, struct scull_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->size = scull_size(sculld);
+	st->qsets = sculld->qset_len;
+	st->blocks = sculld->nr_blocks;
+	st->pool_blocks = sculld->pool_len;
+	st->page_allocs = sculld->page_allocs;
+	st->pool_hits = sculld->pool_hits;
+	st->block_size = scull_block_len(sculld);
+	st->qset = sculld->qlen;
+}
+
 static int scull_open(struct inode *idev, struct file *filp)
 {
 	struct scull_device *sculld;
@@ -79,7 +319,7 @@ static int scull_open(struct inode *idev, struct file *filp)
 
 	pr_alert("Opening file\n");
 
-	sculld = container_of(idev->i_cdev, struct scull_device, chardev);
+	sculld = &scull_devs[iminor(idev) - minor];
 	if (unlikely(!filp))
 		return -1;
 
@@ -90,194 +330,498 @@ static int scull_open(struct inode *idev, struct file *filp)
 		return -1;
 	}
 
+	/*
+	 * Every open maps through the same address_space, even via another
+	 * device node, so scull_unmap() reaches all of them.
+	 */
+	if (!READ_ONCE(sculld->inode)) {
+		struct inode *inode = igrab(idev);
+
+		if (inode && cmpxchg(&sculld->inode, NULL, inode))
+			iput(inode);
+	}
+	if (sculld->inode)
+		filp->f_mapping = sculld->inode->i_mapping;
+
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
 		pr_alert("Write only mode\n");
-		ret = down_interruptible(&sculld->sem);
+		ret = down_write_killable(&sculld->rwsem);
 		if (ret < 0)
 			return ret;
 		ret = scull_trunc(sculld);
-		if (ret < 0) {
-			up(&sculld->sem);
-			return ret;
-		}
-		sculld->used_qblk = 0;
-		sculld->datalen = 0;
-		up(&sculld->sem);
+		up_write(&sculld->rwsem);
 	}
 
 	return ret;
 }
 
-static ssize_t scull_read(struct file *filp, char __user *ubuf, size_t buflen, loff_t *loff)
+/* Only the block table is allocated, blocks come on first touch */
+static struct qset *init_qset(int qlen)
 {
-	struct scull_device *sculld = filp->private_data;
-	int ret;
-	int bytes2read;
-	int readbytes;
-	int off = 0;
-	int i = 0;
+	struct qset *qset;
 
-	pr_alert("Reading file %lu\n", buflen);
-	if (!sculld)
-		return -ENODEV;
-	if (!curset)
-		return 0;
+	qset = kmalloc(sizeof(struct qset), GFP_KERNEL);
+	if (!qset) {
+		pr_alert("kmalloc failed for quantum\n ");
+		return NULL;
+	}
 
-	bytes2read = (sculld->used_qblk * BLOCK_LEN) + sculld->datalen;
-	pr_info("bytes2read: %d\n", bytes2read);
-	pr_info("*loff in read : %lld\n", *loff);
-
-	off = *loff % BLOCK_LEN;
-	if (*loff >= BLOCK_LEN)
-		i = *loff / BLOCK_LEN;
-
-	/* Read 4KB/bytes2read/buflen at a time until limit is reached */
-	if ((signed int)(*loff) < bytes2read) {  /* loff is current offset for this fd */
-		if (buflen <= BLOCK_LEN) {
-			if (bytes2read > (*loff + buflen)) {
-				ret = copy_to_user(ubuf, curset->data[i] + off, buflen);
-				readbytes = buflen - ret;
-			} else {
-				ret = copy_to_user(ubuf, curset->data[i] + off, bytes2read - off);
-				readbytes = bytes2read - off - ret;
-			}
-		} else {
-			ret = copy_to_user(ubuf, curset->data[i] + off, BLOCK_LEN);
-			readbytes = buflen - ret;
-		}
-		*loff += readbytes;
-	} else { /* Return value unspecified if bytes requested is more, prevent retry */
-		readbytes = buflen;
+	qset->data = kcalloc(qlen, sizeof(char *), GFP_KERNEL);
+	if (!qset->data) {
+		pr_alert("kmalloc failed for quantum->data\n ");
+		kfree(qset);
+		return NULL;
 	}
+	return qset;
+}
 
+/*
+ * Returns the block holding offset pos and the offset within it. If the
+ * block or its quantum set doesn't exist yet it is created when alloc is
+ * set, otherwise NULL is returned and *off is still valid. Called with
+ * sculld->rwsem held, for write if alloc is set.
+ */
+static void *scull_follow(struct scull_device *sculld, loff_t pos, int *off, bool alloc)
+{
+	struct qset *qset;
+	unsigned long q;
+	size_t block_len = scull_block_len(sculld);
+	u32 rem;
+	int ret;
+	int i;
 
-	return readbytes;
+	q = div_u64_rem(pos, scull_quanta(sculld), &rem);
+	*off = rem % block_len;
+	qset = xa_load(&sculld->qsets, q);
+	if (!qset) {
+		if (!alloc)
+			return NULL;
+		qset = init_qset(sculld->qlen);
+		if (!qset)
+			return NULL;
+		ret = xa_err(xa_store(&sculld->qsets, q, qset, GFP_KERNEL));
+		if (ret) {
+			free_qset(sculld, qset);
+			return NULL;
+		}
+		sculld->qset_len++;
+	}
+
+	i = rem / block_len;
+	if (!qset->data[i] && alloc)
+		qset->data[i] = scull_alloc_block(sculld);
+	return qset->data[i];
 }
 
-static int init_qset(struct scull_device *sculld, struct qset **curset)
+/*
+ * Like scull_follow() with alloc set, but called with sculld->rwsem held
+ * for read. Only a missing block takes the lock exclusively, and it is
+ * downgraded again before returning.
+ */
+static void *scull_follow_alloc(struct scull_device *sculld, loff_t pos, int *off)
 {
-	int i;
-	int k = 0;
+	void *block;
 
-	if (!sculld)
-		return -1;
+	block = scull_follow(sculld, pos, off, false);
+	if (block)
+		return block;
 
-	sculld->qset_hd = kmalloc(sizeof(struct qset), GFP_KERNEL);
+	up_read(&sculld->rwsem);
+	down_write(&sculld->rwsem);
+	block = scull_follow(sculld, pos, off, true);
+	downgrade_write(&sculld->rwsem);
+	return block;
+}
 
-	if (!sculld->qset_hd) {
-		pr_alert("kmalloc failed for quantum\n ");
-		return -1;
+/*
+ * Back [0, len) with blocks ahead of time, without changing the size.
+ * Blocks allocated before a failure stay, as after a short fallocate.
+ */
+static int scull_prealloc(struct scull_device *sculld, loff_t len)
+{
+	loff_t pos;
+	int off;
+
+	for (pos = 0; pos < len; pos += scull_block_len(sculld)) {
+		/* Everyone else is locked out meanwhile, let the caller go */
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		if (!scull_follow(sculld, pos, &off, true))
+			return -ENOMEM;
+		cond_resched();
 	}
+	return 0;
+}
 
-	*curset = sculld->qset_hd;
+/*
+ * Copy out as much of [ki_pos, size) as the iterator holds, a block at a
+ * time. Blocks that were never written are holes and read as zeroes.
+ *
+ * The destination may be a mapping of this same device, whose fault
+ * handler takes rwsem, so the copy runs unlocked on a reference to the
+ * block page, as splice does. A truncate meanwhile can't free the page
+ * under us.
+ */
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_device *sculld = iocb->ki_filp->private_data;
+	loff_t pos = iocb->ki_pos;
+	struct page *page;
+	size_t block_len;
+	size_t copied = 0;
+	size_t chunk;
+	ssize_t ret = 0;
+	loff_t size;
+	size_t n;
+	void *block;
+	int off;
 
-	(*curset)->data = kmalloc_array(QLEN, sizeof(char *), GFP_KERNEL);
-	if (!((*curset)->data)) {
-		pr_alert("kmalloc failed for quantum->data\n ");
-		kfree(*curset);
-		return -1;
-	}
+	if (!sculld)
+		return -ENODEV;
 
-	for (i = 0; i < QLEN; i++) {
-		(*curset)->data[i] = kmalloc(BLOCK_LEN, GFP_KERNEL);
-		if (!((*curset)->data[i])) {
-			pr_alert("kmalloc failed for quantum->data\n ");
-			for (k = 0; k < i; k++) {
-				if (!(*curset)->data[k])
-					continue;
-				kfree((*curset)->data[k]);
-			}
-
-			kfree((*curset)->data);
-			kfree(*curset);
-			return -1;
+	while (iov_iter_count(to)) {
+		if (down_read_killable(&sculld->rwsem)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		size = scull_size(sculld);
+		if (pos >= size) {
+			up_read(&sculld->rwsem);
+			break;
+		}
+		block_len = scull_block_len(sculld);
+		block = scull_follow(sculld, pos, &off, false);
+		chunk = min_t(loff_t, block_len - off, size - pos);
+		chunk = min(chunk, iov_iter_count(to));
+		page = block ? virt_to_page(block) : NULL;
+		if (page)
+			get_page(page);
+		up_read(&sculld->rwsem);
+
+		if (page) {
+			n = copy_to_iter(block + off, chunk, to);
+			put_page(page);
+		} else {
+			n = iov_iter_zero(chunk, to);
+		}
+		copied += n;
+		pos += n;
+		/* Faulted on the user buffer */
+		if (n < chunk) {
+			ret = -EFAULT;
+			break;
 		}
 	}
-	(*curset)->next = NULL;
-	return 0;
+	iocb->ki_pos = pos;
+
+	return copied ? copied : ret;
 }
 
+/* Appends hold the map exclusively so the end can't move under them */
+static int scull_write_lock(struct scull_device *sculld, bool append)
+{
+	if (append)
+		return down_write_killable(&sculld->rwsem);
+	return down_read_killable(&sculld->rwsem);
+}
 
-static ssize_t scull_write(struct file *filp, const char __user *ubuf, size_t buflen, loff_t *loff)
+static void scull_write_unlock(struct scull_device *sculld, bool append)
 {
-	/* Write buffer to memory. */
-	struct scull_device *sculld = filp->private_data;
-	int copied;
-	int ret;
-	int quanta = BLOCK_LEN * QLEN;
+	if (append)
+		up_write(&sculld->rwsem);
+	else
+		up_read(&sculld->rwsem);
+}
 
-	pr_alert("Writing file %lu\n", buflen);
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	/* Write buffer to memory. */
+	struct scull_device *sculld = iocb->ki_filp->private_data;
+	bool append = iocb->ki_flags & IOCB_APPEND;
+	size_t buflen = iov_iter_count(from);
+	size_t copied = 0;
+	loff_t pos = iocb->ki_pos;
+	size_t chunk;
+	size_t n;
+	void *block;
+	int off;
+	int ret = 0;
 
 	if (!sculld)
-		return -1;
+		return -ENODEV;
 
-	ret = down_interruptible(&sculld->sem);
+	ret = scull_write_lock(sculld, append);
 	if (ret < 0)
 		return ret;
-	/*Allocate memory for the quantum set, assign qset address to head of qset list. */
-	if (!sculld->qset_hd) {
-		ret = init_qset(sculld, &curset);
+
+	/* Copy a block at a time, growing the device a quantum set at a time */
+	while (copied < buflen) {
+		if (append) {
+			/* The end may have moved while the lock was dropped */
+			pos = scull_size(sculld);
+			block = scull_follow(sculld, pos, &off, true);
+		} else {
+			block = scull_follow_alloc(sculld, pos, &off);
+		}
+		if (!block) {
+			ret = -ENOMEM;
+			break;
+		}
+		chunk = min_t(size_t, buflen - copied, scull_block_len(sculld) - off);
+		/*
+		 * The source may be a mapping of this same device, whose fault
+		 * handler takes rwsem: never fault on it with the lock held.
+		 * copy_from_iter returns bytes actually copied.
+		 */
+		pagefault_disable();
+		n = copy_from_iter(block + off, chunk, from);
+		pagefault_enable();
+		copied += n;
+		pos += n;
+		scull_extend(sculld, pos);
+		if (n == chunk)
+			continue;
+
+		/* Fault the rest of the chunk in unlocked and try again */
+		scull_write_unlock(sculld, append);
+		if (iov_iter_fault_in_readable(from, chunk - n)) {
+			iocb->ki_pos = pos;
+			return copied ? copied : -EFAULT;
+		}
+		ret = scull_write_lock(sculld, append);
 		if (ret < 0) {
-			up(&sculld->sem);
-			return -ENOMEM;
+			iocb->ki_pos = pos;
+			return copied ? copied : ret;
 		}
-	} else {
-		curset = sculld->qset_hd;
 	}
 
-	if ((*loff + buflen) <= quanta) {
-		/* Copying at most a block at a time */
-		if (buflen >= BLOCK_LEN) {
-			/* copy_from_user returns bytes still to be copied */
-			ret = copy_from_user(curset->data[sculld->used_qblk] + sculld->datalen, ubuf, BLOCK_LEN);
-			if (ret < 0) {
-				up(&sculld->sem);
-				return -EFAULT;
-			}
-			/* So copied contains (requested copy length - bytes still to be copied) */
-			copied = (BLOCK_LEN - ret);
-		} else {
-			ret = copy_from_user(curset->data[sculld->used_qblk] + sculld->datalen, ubuf, buflen);
-			if (ret < 0) {
-				up(&sculld->sem);
-				return -EFAULT;
-			}
-			copied = (buflen - ret);
-		}
+	iocb->ki_pos = pos;
+	scull_write_unlock(sculld, append);
+	return copied ? copied : ret;
+}
 
-		/*Update used blocks and offset within block */
-		sculld->used_qblk = ((sculld->used_qblk * BLOCK_LEN) + copied) / BLOCK_LEN;
-		sculld->datalen = ((sculld->used_qblk * BLOCK_LEN) + copied) % BLOCK_LEN;
-		*loff = *loff + copied;
+static int scull_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	/* Blocks still belong to the device */
+	return 1;
+}
 
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = scull_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
 
-		up(&sculld->sem);
-		return copied;
-	} else {
-		/*TODO: Copy remaining bytes in this quantaa
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
 
-		  Create new quanta
+/*
+ * Hand the block pages themselves to the pipe instead of copying them.
+ * Each pipe buffer holds a page reference, so a truncate meanwhile
+ * doesn't free the page under the reader (and keeps it out of the
+ * pool), but a later write to the same offset is visible through it,
+ * as with splice from the page cache. Holes are the zero page.
+ */
+static ssize_t scull_splice_read(struct file *filp, loff_t *ppos,
+				 struct pipe_inode_info *pipe, size_t len,
+				 unsigned int flags)
+{
+	struct scull_device *sculld = filp->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &scull_pipe_buf_ops,
+		.spd_release = scull_spd_release,
+	};
+	loff_t pos = *ppos;
+	struct page *page;
+	size_t chunk;
+	loff_t size;
+	void *block;
+	ssize_t ret;
+	int off;
+
+	if (down_read_killable(&sculld->rwsem))
+		return -ERESTARTSYS;
+
+	size = scull_size(sculld);
+	while (len && pos < size && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		block = scull_follow(sculld, pos, &off, false);
+		chunk = min_t(loff_t, PAGE_SIZE - offset_in_page(off), size - pos);
+		chunk = min(chunk, len);
+		page = block ? virt_to_page(block + off) : ZERO_PAGE(0);
+		get_page(page);
+
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = offset_in_page(off);
+		partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		pos += chunk;
+		len -= chunk;
+	}
 
-		  Continue copy in new quanta
+	up_read(&sculld->rwsem);
+	if (!spd.nr_pages)
+		return 0;
 
-		  Updata next pointer and qset len
-		 */
+	/* Releases whatever didn't fit */
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0)
+		*ppos += ret;
+	return ret;
+}
+
+/*
+ * Find the first offset at or after pos that is backed by a block
+ * (SEEK_DATA) or isn't (SEEK_HOLE). The end of the device counts as a
+ * hole. Called with sculld->rwsem held for read.
+ */
+static loff_t scull_seek_data_hole(struct scull_device *sculld, loff_t pos, int whence)
+{
+	loff_t size = scull_size(sculld);
+	size_t block_len = scull_block_len(sculld);
+	u32 quanta = scull_quanta(sculld);
+	unsigned long q;
+	void *block;
+	int off;
+
+	if (pos < 0 || pos >= size)
+		return -ENXIO;
+
+	while (pos < size) {
+		block = scull_follow(sculld, pos, &off, false);
+		if (!block == (whence == SEEK_HOLE))
+			return pos;
+
+		q = div_u64(pos, quanta);
+		if (whence == SEEK_DATA && !xa_load(&sculld->qsets, q)) {
+			/* Skip quantum sets that were never touched in one go */
+			if (!xa_find_after(&sculld->qsets, &q, ULONG_MAX, XA_PRESENT))
+				break;
+			pos = (loff_t)q * quanta;
+			continue;
+		}
+		pos += block_len - off;
 	}
 
-	up(&sculld->sem);
-	return buflen;
+	return whence == SEEK_DATA ? -ENXIO : size;
+}
+
+static loff_t scull_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct scull_device *sculld = filp->private_data;
+	loff_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+	case SEEK_CUR:
+	case SEEK_END:
+		return generic_file_llseek_size(filp, off, whence, MAX_LFS_FILESIZE,
+						scull_size(sculld));
+
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if (down_read_killable(&sculld->rwsem))
+			return -ERESTARTSYS;
+		pos = scull_seek_data_hole(sculld, off, whence);
+		up_read(&sculld->rwsem);
+		if (pos < 0)
+			return pos;
+		return vfs_setpos(filp, pos, MAX_LFS_FILESIZE);
+
+	default:
+		return -EINVAL;
+	}
 }
 
 static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	long ret;
+	struct scull_device *sculld = filp->private_data;
+	void __user *uarg = (void __user *)arg;
+	struct scull_geometry geo;
+	struct scull_stats st;
+	__u64 len;
+	long ret = 0;
 
 	switch (cmd) {
 	case SCULL_IOC_QQUANTA:
-		ret = QLEN * BLOCK_LEN;
+		ret = scull_quanta(sculld);
 		break;
 
 	case SCULL_IOC_TQUANTA:
+		if (down_write_killable(&sculld->rwsem))
+			return -ERESTARTSYS;
+		ret = scull_set_geometry(sculld, sculld->qlen, arg);
+		up_write(&sculld->rwsem);
+		break;
+
+	case SCULL_IOC_VERSION:
+		ret = SCULL_IOC_VERSION_NR;
+		break;
+
+	case SCULL_IOC_GSIZE:
+		len = scull_size(sculld);
+		if (put_user(len, (__u64 __user *)uarg))
+			return -EFAULT;
+		break;
+
+	case SCULL_IOC_SGEOMETRY:
+		if (copy_from_user(&geo, uarg, sizeof(geo)))
+			return -EFAULT;
+		if (down_write_killable(&sculld->rwsem))
+			return -ERESTARTSYS;
+		/* Zero keeps the current value */
+		ret = scull_set_geometry(sculld, geo.qset ?: sculld->qlen,
+					 geo.block_size ?: scull_block_len(sculld));
+		up_write(&sculld->rwsem);
+		break;
+
+	case SCULL_IOC_GGEOMETRY:
+		if (down_read_killable(&sculld->rwsem))
+			return -ERESTARTSYS;
+		geo.qset = sculld->qlen;
+		geo.block_size = scull_block_len(sculld);
+		up_read(&sculld->rwsem);
+		if (copy_to_user(uarg, &geo, sizeof(geo)))
+			return -EFAULT;
+		break;
+
+	case SCULL_IOC_TRUNCATE:
+		if (get_user(len, (__u64 __user *)uarg))
+			return -EFAULT;
+		if (len > MAX_LFS_FILESIZE)
+			return -EFBIG;
+		if (down_write_killable(&sculld->rwsem))
+			return -ERESTARTSYS;
+		ret = scull_truncate(sculld, len);
+		up_write(&sculld->rwsem);
+		break;
+
+	case SCULL_IOC_GSTATS:
+		if (down_read_killable(&sculld->rwsem))
+			return -ERESTARTSYS;
+		scull_get_stats(sculld, &st);
+		up_read(&sculld->rwsem);
+		if (copy_to_user(uarg, &st, sizeof(st)))
+			return -EFAULT;
+		break;
+
+	case SCULL_IOC_PREALLOC:
+		if (get_user(len, (__u64 __user *)uarg))
+			return -EFAULT;
+		/* Blocks are pinned until truncated, leave the rest of RAM to others */
+		if (len > (u64)(totalram_pages() / 2) << PAGE_SHIFT)
+			return -ENOMEM;
+		if (down_write_killable(&sculld->rwsem))
+			return -ERESTARTSYS;
+		ret = scull_prealloc(sculld, len);
+		up_write(&sculld->rwsem);
 		break;
 
 	default:
@@ -297,29 +841,68 @@ static void scull_vma_close(struct vm_area_struct *vma)
 	pr_alert("Inside mmap vma close\n");
 }
 
+/*
+ * Resolve one page of the mapping to the block backing it. Shared
+ * mappings allocate missing blocks, since a later store through the
+ * pte would otherwise never reach the device; a shared write fault
+ * past the end grows the device like a write() would. Private mappings
+ * see holes as the zero page and get their own copy on write.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_device *sculld = vma->vm_private_data;
+	loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+	bool shared = vma->vm_flags & VM_SHARED;
+	vm_fault_t ret = 0;
+	struct page *page;
+	void *block;
+	int off;
+
+	down_read(&sculld->rwsem);
+	if (pos >= scull_size(sculld) &&
+	    !(shared && (vmf->flags & FAULT_FLAG_WRITE))) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	if (shared)
+		block = scull_follow_alloc(sculld, pos, &off);
+	else
+		block = scull_follow(sculld, pos, &off, false);
+	if (block) {
+		page = virt_to_page(block + off);
+		/* Only a shared write fault gets this far past the end */
+		if (shared && (vmf->flags & FAULT_FLAG_WRITE) &&
+		    pos >= scull_size(sculld))
+			scull_extend(sculld, pos + PAGE_SIZE);
+	} else if (shared) {
+		ret = VM_FAULT_OOM;
+		goto out;
+	} else {
+		page = ZERO_PAGE(0);
+	}
+	get_page(page);
+	vmf->page = page;
+out:
+	up_read(&sculld->rwsem);
+	return ret;
+}
+
 const struct vm_operations_struct scull_vma_ops = {
 	.open = scull_vma_open,
-	.close = scull_vma_close
+	.close = scull_vma_close,
+	.fault = scull_vma_fault
 };
 
 static int scull_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int ret;
-	unsigned long physaddr;
-	unsigned long pfn;
 	struct scull_device *sculld = filp->private_data;
 
 	pr_info("Inside mmap call\n");
-	/* Obtain physical page frame of the buffer */
-	physaddr = __pa(sculld->qset_hd->data[0]);
-	pfn = physaddr >> PAGE_SHIFT;
-	pr_info("virt_addr: %lx; physaddr: %lx; pfn : %lu\n", (unsigned long)sculld->qset_hd->data, physaddr, pfn);
-	pr_info("data[0] is %c\n", ((char *)sculld->qset_hd->data[0])[0]);
-	
-	/* Create the page table mapping, heavy work done by kernel */
-	ret = remap_pfn_range(vma, vma->vm_start, pfn, vma->vm_end - vma->vm_start, vma->vm_page_prot);
-	if (ret < 0)
-		return ret;
+	/* Pages are filled in one at a time by scull_vma_fault */
+	vma->vm_private_data = sculld;
+	vma->vm_flags |= VM_DONTEXPAND;
 
 	/* Register vma_ops */
 	vma->vm_ops = &scull_vma_ops;
@@ -338,74 +921,97 @@ static int scull_close(struct inode *idev, struct file *filp)
 const struct file_operations scull_fops = {
 	.owner = THIS_MODULE,
 	.open = scull_open,
-	.read = scull_read,
-	.write = scull_write,
+	.llseek = scull_llseek,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scull_ioctl,
 	.mmap = scull_mmap,
 	.release = scull_close
 };
 
+static void scull_dev_init(struct scull_device *sculld)
+{
+	xa_init(&sculld->qsets);
+	sculld->qset_len = 0;
+	atomic64_set(&sculld->size, 0);
+	sculld->block_order = block_order;
+	sculld->qlen = QLEN;
+	init_rwsem(&sculld->rwsem);
+}
+
 static int cdev_setup(void)
 {
 	int err;
 	int devno;
+	int i;
 
 	devno = MKDEV(major, minor);
+	for (i = 0; i < ndevs; i++)
+		scull_dev_init(&scull_devs[i]);
+
 	//initialize cdev structure
-	cdev_init(&(scull_dev.chardev), &scull_fops);
-	scull_dev.chardev.owner = THIS_MODULE;
-	scull_dev.chardev.ops = &scull_fops;
-	scull_dev.qset_len = 1;
-	scull_dev.used_qblk = 0;
-	scull_dev.datalen = 0;
-	sema_init(&scull_dev.sem, 1);
+	cdev_init(&scull_cdev, &scull_fops);
+	scull_cdev.owner = THIS_MODULE;
 
-	//add cdev structurei
-	err = cdev_add(&(scull_dev.chardev), devno, MAX_DEVICE);
+	//add cdev structure, one for the whole minor range
+	err = cdev_add(&scull_cdev, devno, ndevs);
 
 	return err;
 }
 
 static int __init scull_init(void)
 {
-	int i = 0;
 	int err;
 
-	minor = 0;
-	curset = NULL;
-	//Ask system to assign major number for device
-	while (i++ < MAX_DEVICE) {
-		int ret = alloc_chrdev_region(&scull_id, minor, MAX_DEVICE, "scull1");
+	if (block_order >= MAX_ORDER || ndevs < 1 || ndevs > MINORMASK)
+		return -EINVAL;
 
-		if (ret)
-			goto fail;
-	}
+	scull_devs = kcalloc(ndevs, sizeof(*scull_devs), GFP_KERNEL);
+	if (!scull_devs)
+		return -ENOMEM;
+
+	minor = 0;
+	//Ask system to assign major number for all the devices
+	err = alloc_chrdev_region(&scull_id, minor, ndevs, "scull1");
+	if (err)
+		goto fail_region;
 
 	major = MAJOR(scull_id);
 	pr_alert("scull id is %x\n", scull_id);
 	err = cdev_setup();
 	if (err)
-		goto fail;
+		goto fail_cdev;
 	pr_alert("Loaded %s\n", __func__);
 	return 0;
 
 
-fail:
+fail_cdev:
 	//unalloc_region
-	unregister_chrdev_region(scull_id, MAX_DEVICE);
+	unregister_chrdev_region(scull_id, ndevs);
+fail_region:
+	kfree(scull_devs);
 
 	pr_alert("Error in %s\n", __func__);
-	return -1;
+	return err;
 }
 
 static void __exit scull_exit(void)
 {
-	//free buffer memory
-	scull_trunc(&sculld);
+	int i;
+
 	//Delete device
-	cdev_del(&(scull_dev.chardev));
+	cdev_del(&scull_cdev);
+	//free buffer memory
+	for (i = 0; i < ndevs; i++) {
+		scull_trunc(&scull_devs[i]);
+		scull_drain_pool(&scull_devs[i]);
+		iput(scull_devs[i].inode);
+	}
+	kfree(scull_devs);
 	//unregister driver
-	unregister_chrdev_region(scull_id, MAX_DEVICE);
+	unregister_chrdev_region(scull_id, ndevs);
 
 	pr_alert("Exited %s\n", __func__);
 }
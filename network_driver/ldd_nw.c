@@ -1,4 +1,5 @@
 #include<linux/netdevice.h>
+#include<linux/rtnetlink.h>
 #include<linux/skbuff.h>
 #include<linux/if_ether.h>
 #include<linux/etherdevice.h>
@@ -7,40 +8,152 @@
 #include<linux/mm.h>
 #include<linux/in6.h>
 #include<linux/ip.h>
+#include<linux/tcp.h>
+#include<linux/udp.h>
+#include<net/checksum.h>
+#include<linux/cpumask.h>
+#include<linux/log2.h>
+#include<linux/u64_stats_sync.h>
 
 #define RX_INT_ENABLED 0x01
 #define TX_INT_ENABLED 0x02
+/* Descriptors per ring, a power of two */
+#define SNULL_RING_SIZE 256
+/* Free TX descriptors needed before a stopped queue is woken again */
+#define SNULL_TX_WAKE (SNULL_RING_SIZE / 4)
+/* Upper bound on queues per device, one per CPU below that */
+#define SNULL_MAX_QUEUES 16
+/* Offloads the virtual wire can carry, super-packets cross it intact */
+#define SNULL_FEATURES (NETIF_F_HW_CSUM | NETIF_F_RXCSUM | NETIF_F_SG | \
+                        NETIF_F_FRAGLIST | NETIF_F_HIGHDMA | NETIF_F_GSO_SOFTWARE)
 
 struct net_device *mydev[2];
 unsigned long int timeout = 100UL;
+static unsigned int snull_nqueues;
+
+/* Nothing on the wire limits frame size, up to ETH_MAX_MTU works */
+static unsigned int mtu = ETH_DATA_LEN;
+module_param(mtu, uint, 0444);
+MODULE_PARM_DESC(mtu, "Initial MTU of the ldd interfaces");
+
 static void snull_interrupt_hdlr(int irq, void *dev_id, struct pt_regs *regs);
 
-/* Only shared resource in this driver, thus protected by a spinlock */
+/*
+   A descriptor points at the packet buffer, here an skb.
+   TX descriptors only keep the length, the skb itself has
+   already been handed to the peer.
+*/
+struct snull_desc {
+    struct sk_buff *skb;
+    unsigned int len;
+};
+
+/*
+   Simulated descriptor ring. head and tail run freely and
+   are masked to a slot, so head - tail is the number of
+   descriptors in use. Every ring has exactly one producer
+   and one consumer, so it needs no lock: each side owns
+   its index and publishes it with a release store.
+   TX ring: snull_hard_start_xmit on this queue produces at
+            head once the "hardware" has sent the packet,
+            snull_tx_clean completes from tail.
+   RX ring: the peer's snull_hw_tx on the same queue index
+            produces at head, snull_poll delivers from tail.
+*/
+struct snull_ring {
+    struct snull_desc desc[SNULL_RING_SIZE];
+    unsigned int head ____cacheline_aligned_in_smp;
+    unsigned int tail ____cacheline_aligned_in_smp;
+};
+
+/*
+   One hardware queue pair: TX queue i of a device sends into
+   RX queue i of its peer, and one NAPI instance serves both
+   rings of the pair. Counters are written by that NAPI
+   instance only, drops go to dev->{rx,tx}_dropped.
+*/
+struct snull_queue {
+    struct snull_priv *priv;
+    unsigned int index;
+    unsigned long status;  //Simulates a per queue status register
+    struct napi_struct napi;
+    struct snull_ring tx_ring;
+    struct snull_ring rx_ring;
+    struct u64_stats_sync syncp;
+    u64 rx_packets;
+    u64 rx_bytes;
+    u64 tx_packets;
+    u64 tx_bytes;
+} ____cacheline_aligned_in_smp;
+
 struct snull_priv {
-    struct rtnl_link_stats64 stats;
-    int status;  //Simulates a device status register
-    struct sk_buff *skb; //Saves socket buffers
-    u8 rx_int_enabled;
-    u8 tx_int_enabled;
-    int tx_packetlen;
-    u8 *tx_packet;
-    spinlock_t lock; // lock is a spinlock  used only to serialize access to snull_priv structure
+    struct net_device *dev;
+    unsigned int nqueues;
+    struct snull_queue queues[];
 };
 
+static inline unsigned int snull_ring_used(struct snull_ring *ring)
+{
+    return READ_ONCE(ring->head) - READ_ONCE(ring->tail);
+}
 
-static void status_update(struct snull_priv *priv, int intrpt_enable_flag) 
+static inline struct snull_desc *snull_ring_desc(struct snull_ring *ring, unsigned int idx)
 {
-    if (!priv) {
-        pr_warning("Could not update status, uninitialized priv");
+    return &ring->desc[idx & (SNULL_RING_SIZE - 1)];
+}
+
+/* Producer side, fails when the ring is full */
+static bool snull_ring_put(struct snull_ring *ring, struct sk_buff *skb, unsigned int len)
+{
+    unsigned int head = ring->head;
+    struct snull_desc *desc;
+
+    /* Pairs with the release of tail by the consumer */
+    if (head - smp_load_acquire(&ring->tail) == SNULL_RING_SIZE)
+        return false;
+    desc = snull_ring_desc(ring, head);
+    desc->skb = skb;
+    desc->len = len;
+    /* Descriptor contents before the new head */
+    smp_store_release(&ring->head, head + 1);
+    return true;
+}
+
+/* Drops whatever the ring still holds, called with both sides idle */
+static void snull_ring_purge(struct snull_ring *ring)
+{
+    struct snull_desc *desc;
+
+    while (ring->tail != ring->head) {
+        desc = snull_ring_desc(ring, ring->tail++);
+        dev_kfree_skb_any(desc->skb);
+        desc->skb = NULL;
+    }
+}
+
+static struct net_device *snull_peer(struct net_device *snull_dev)
+{
+    return snull_dev == mydev[0] ? mydev[1] : mydev[0];
+}
+
+static void status_update(struct snull_queue *q, int intrpt_enable_flag) 
+{
+    if (!q) {
+        pr_warning("Could not update status, uninitialized queue");
         return;
     }
     /* can be RX_INT_ENABLED or TX_INT_ENABLED */
-    priv->status |= intrpt_enable_flag ;   
+    set_bit(ilog2(intrpt_enable_flag), &q->status);
 }
 
 /* Invoked when interface is brought up */
 static int snull_open(struct net_device *snull_dev)
 {
+    struct snull_priv *priv;
+    cpumask_var_t mask;
+    unsigned int i;
+    int cpu;
+
     if (!snull_dev)
         return -1;
 
@@ -50,36 +163,124 @@ static int snull_open(struct net_device *snull_dev)
         memcpy(snull_dev->dev_addr, "\0SNUL0", ETH_ALEN) ;
     else
         memcpy(snull_dev->dev_addr, "\0SNUL1", ETH_ALEN) ;
+    /* Start polling the rings */
+    priv = netdev_priv(snull_dev);
+    for (i = 0; i < priv->nqueues; i++)
+        napi_enable(&priv->queues[i].napi);
+    /*
+       XPS: each CPU transmits on its own queue (cpu % nqueues),
+       so flows from different cores never share a ring
+    */
+    if (zalloc_cpumask_var(&mask, GFP_KERNEL)) {
+        for (i = 0; i < priv->nqueues; i++) {
+            cpumask_clear(mask);
+            for_each_possible_cpu(cpu)
+                if (cpu % priv->nqueues == i)
+                    cpumask_set_cpu(cpu, mask);
+            netif_set_xps_queue(snull_dev, mask, i);
+        }
+        free_cpumask_var(mask);
+    }
     /* Starts device 'transmission queue' which 
        is ultimately a memory that the kernel 
        assigns for the device */
-    netif_start_queue(snull_dev);
+    netif_tx_start_all_queues(snull_dev);
     return 0;
 }
 
 /* Invoked when interface is brought down */
 static int snull_stop(struct net_device *snull_dev)
 {
+    struct snull_priv *priv;
+    unsigned int i;
+
     if(!snull_dev)
         return -1;
    
-    netif_stop_queue(snull_dev);
+    netif_tx_disable(snull_dev);
+    priv = netdev_priv(snull_dev);
+    for (i = 0; i < priv->nqueues; i++)
+        napi_disable(&priv->queues[i].napi);
+    /*
+       The peer checks netif_running() before posting to our
+       RX rings, wait out transmits that saw us still up
+    */
+    synchronize_net();
+    /* Nobody will poll these anymore */
+    for (i = 0; i < priv->nqueues; i++) {
+        snull_ring_purge(&priv->queues[i].tx_ring);
+        snull_ring_purge(&priv->queues[i].rx_ring);
+    }
     return 0;
 }
 
 /* Low level hw transmission interface */
-static int snull_hw_tx(u8 *pkt, int len, struct net_device *snull_dev) 
+static int snull_rx(struct net_device *snull_dev, struct snull_queue *q, struct sk_buff *skb);
+
+/*
+   The TCP/UDP checksum covers the IP addresses through the
+   pseudo header, so it has to follow the rewrite. For
+   CHECKSUM_PARTIAL (always the case for GSO) the field holds
+   only the pseudo header sum, inet_proto_csum_replace4()
+   handles both forms.
+*/
+static int snull_mangle_l4(struct sk_buff *skb, struct iphdr *iphdr, __be32 saddr, __be32 daddr)
+{
+    unsigned int off = ETH_HLEN + iphdr->ihl * 4;
+    __be32 new_saddr = iphdr->saddr;
+    __be32 new_daddr = iphdr->daddr;
+    u8 protocol = iphdr->protocol;
+    __sum16 *check;
+
+    /* Only the first fragment carries the L4 header */
+    if (iphdr->frag_off & htons(IP_OFFSET))
+        return 0;
+    switch (protocol) {
+    case IPPROTO_TCP:
+        off += offsetof(struct tcphdr, check);
+        break;
+    case IPPROTO_UDP:
+        off += offsetof(struct udphdr, check);
+        break;
+    default:
+        return 0;
+    }
+    /* iphdr is stale after this, it may have moved */
+    if (skb_ensure_writable(skb, off + sizeof(__sum16)))
+        return -1;
+    check = (__sum16 *)(skb->data + off);
+    /* A zero UDP checksum means none was computed */
+    if (protocol == IPPROTO_UDP && !*check &&
+        skb->ip_summed != CHECKSUM_PARTIAL)
+        return 0;
+    inet_proto_csum_replace4(check, skb, saddr, new_saddr, true);
+    inet_proto_csum_replace4(check, skb, daddr, new_daddr, true);
+    return 0;
+}
+
+/*
+   Rewrites the IPv4 addresses as described in the README.
+   skb_ensure_writable() makes only the headers private when
+   the skb is a clone (e.g. TCP keeps one for retransmission),
+   the payload stays shared.
+*/
+static int snull_mangle_ip(struct sk_buff *skb)
 {
-    struct net_device *dest;
-    struct snull_priv *priv;
-    struct snull_priv *priv_dest;
     struct iphdr *iphdr;
+    __be32 saddr, daddr;
 
-    if(!pkt || !snull_dev)
+    if (skb->protocol != htons(ETH_P_IP))
+        return 0;
+    if (skb_ensure_writable(skb, ETH_HLEN + sizeof(struct iphdr)))
         return -1;
-
     /* Point to start of IP Header is after Eth Header*/
-    iphdr = (struct iphdr *)(pkt + ETH_HLEN);
+    iphdr = (struct iphdr *)(skb->data + ETH_HLEN);
+    if (iphdr->ihl < 5 || skb_ensure_writable(skb, ETH_HLEN + iphdr->ihl * 4))
+        return -1;
+    /* May have moved */
+    iphdr = (struct iphdr *)(skb->data + ETH_HLEN);
+    saddr = iphdr->saddr;
+    daddr = iphdr->daddr;
     /* Flip the LS bit of 3rd octet of dst,src ip address */
     /* On ARM 32bit, the memory is Little Endian */
     /* To make driver architecture independent, using endian macros */
@@ -87,39 +288,43 @@ static int snull_hw_tx(u8 *pkt, int len, struct net_device *snull_dev)
     iphdr->saddr = be32_to_cpu(cpu_to_be32(iphdr->saddr) ^ 0x00000100);
     iphdr->check = 0;
     iphdr->check = ip_fast_csum(iphdr, iphdr->ihl);  
+    return snull_mangle_l4(skb, iphdr, saddr, daddr);
+}
 
-    /* Fill in the src and dst mac addresses in pkt*/
-    if (snull_dev == mydev[0]) {
-        /* Etherhdr = Dest mac: src mac: protocol */
-        memcpy(pkt + ETH_ALEN, snull_dev->dev_addr, ETH_ALEN);
-        memcpy(pkt, mydev[1]->dev_addr, ETH_ALEN);
-        dest = mydev[1];
-    } else {
-        memcpy(pkt + ETH_ALEN, snull_dev->dev_addr, ETH_ALEN);
-        memcpy(pkt, mydev[0]->dev_addr, ETH_ALEN);
-        dest = mydev[0];
+/* Consumes the skb; fails only when it is dropped before reaching the wire */
+static int snull_hw_tx(struct sk_buff *skb, struct net_device *snull_dev, struct snull_queue *q) 
+{
+    struct net_device *dest;
+    struct snull_priv *priv_dest;
+    struct snull_queue *q_dest;
+    struct ethhdr *eth;
+
+    if(!skb || !snull_dev)
+        return -1;
+
+    if (skb_ensure_writable(skb, ETH_HLEN) || snull_mangle_ip(skb)) {
+        dev_kfree_skb_any(skb);
+        return -1;
     }
-    /* 
-       Signal that packet is ready for reception 
-       Modification of snull_priv, requires the
-       capture of its lock 
-    */
-    priv = netdev_priv(snull_dev);
-    spin_lock(&priv->lock);
-    priv->tx_packetlen = len;
-    priv->tx_packet = pkt;
-    spin_unlock(&priv->lock);  
-    /* 
-       Enable receive interrupt of destination
-       network device 
-    */
+
+    /* Fill in the src and dst mac addresses in pkt*/
+    dest = snull_peer(snull_dev);
+    eth = (struct ethhdr *)skb->data;
+    /* Etherhdr = Dest mac: src mac: protocol */
+    memcpy(eth->h_source, snull_dev->dev_addr, ETH_ALEN);
+    memcpy(eth->h_dest, dest->dev_addr, ETH_ALEN);
+    /* The skb itself crosses the wire into the same queue of the destination */
     priv_dest = netdev_priv(dest);
-    spin_lock(&priv_dest->lock);
-    status_update(priv_dest, RX_INT_ENABLED);
-    priv_dest->rx_int_enabled = 1;
-    spin_unlock(&priv_dest->lock);
-    /* Invoking interrupt handler */
-    snull_interrupt_hdlr(0, dest, NULL);
+    q_dest = &priv_dest->queues[q->index];
+    snull_rx(dest, q_dest, skb);
+    /*
+       Latch the receive status of the destination and
+       the transmit done status of the sender. The
+       interrupts themselves are raised by the doorbell
+       in snull_hard_start_xmit.
+    */
+    status_update(q_dest, RX_INT_ENABLED);
+    status_update(q, TX_INT_ENABLED);
     return 0;
 }
 
@@ -129,147 +334,238 @@ static int snull_hw_tx(u8 *pkt, int len, struct net_device *snull_dev)
  This allows for concurrency safe usage 
  of the device. On return, it will release
  the lock and can be called immediately.
- CHECK: Where in the NW code is the lock obtained?
+ With one lock per TX queue, it is the only
+ producer on that queue's TX ring and on the
+ peer's RX ring of the same index.
 */
 static netdev_tx_t snull_hard_start_xmit(struct sk_buff *skb, struct net_device *snull_dev)
 {
-    u8 buff[ETH_ZLEN];
-    u8 *data;
-    struct snull_priv *priv;
-    int len, ret;
-
-    if(!skb) {
-        pr_err("Socket Buffer is NULL\n");
-        return -1;
+    struct snull_priv *priv = netdev_priv(snull_dev);
+    unsigned int qidx = skb_get_queue_mapping(skb);
+    struct netdev_queue *txq = netdev_get_tx_queue(snull_dev, qidx);
+    struct snull_queue *q = &priv->queues[qidx];
+    netdev_tx_t ret = NETDEV_TX_OK;
+    unsigned int len;
+
+    /* Should not happen, the queue is stopped as the ring fills */
+    if (snull_ring_used(&q->tx_ring) == SNULL_RING_SIZE) {
+        netif_tx_stop_queue(txq);
+        ret = NETDEV_TX_BUSY;
+        goto doorbell;
     }
-    
-    len = skb->len;
-    data = skb->data;
-    /* len,data used inorder to avoid modifying skb(in case retransmission is required) */
-    if (skb->len < ETH_ZLEN) {
-        memset(buff, 0, ETH_ZLEN);
-        memcpy(buff, skb->data, skb->len);
-        len = ETH_ZLEN;
-        data = buff;
+
+    /* Pad runts in the skb itself, it is freed on failure */
+    if (skb_put_padto(skb, ETH_ZLEN)) {
+        atomic_long_inc(&snull_dev->tx_dropped);
+        goto doorbell;
     }
-    /* Save the socket buffer until transmission succeeds */
-    priv = netdev_priv(snull_dev);
-    spin_lock(&priv->lock);
-    priv->skb = skb;
-    spin_unlock(&priv->lock);
     /* Record transmission start time */
     skb_tx_timestamp(skb);
-    /* Call the underlying transmission mechanism */
-    ret = snull_hw_tx(data, len, snull_dev);
-    /* Interrupt upon successful transmission */
-    snull_interrupt_hdlr(0, snull_dev, NULL);
-    return NETDEV_TX_OK;
+    len = skb->len;
+    /* Call the underlying transmission mechanism, it takes the skb */
+    if (snull_hw_tx(skb, snull_dev, q)) {
+        atomic_long_inc(&snull_dev->tx_dropped);
+        goto doorbell;
+    }
+
+    /* The TX descriptor stays in use until its completion is cleaned */
+    snull_ring_put(&q->tx_ring, NULL, len);
+    if (snull_ring_used(&q->tx_ring) == SNULL_RING_SIZE) {
+        netif_tx_stop_queue(txq);
+        /* Pairs with the barrier in snull_tx_clean, recheck after stopping */
+        smp_mb();
+        if (snull_ring_used(&q->tx_ring) <= SNULL_RING_SIZE - SNULL_TX_WAKE)
+            netif_tx_start_queue(txq);
+    }
+
+doorbell:
+    /*
+       Raise interrupts once per batch rather than per packet.
+       Drops ring it too, the batch may end on one of them.
+    */
+    if (!netdev_xmit_more() || netif_xmit_stopped(txq)) {
+        priv = netdev_priv(snull_peer(snull_dev));
+        snull_interrupt_hdlr(qidx, &priv->queues[qidx], NULL);
+        snull_interrupt_hdlr(qidx, q, NULL);
+    }
+    return ret;
 }
 
+/*
+   Completions are only cleaned from NAPI, so a stuck queue
+   means an interrupt got lost: poll every queue again.
+*/
 static void snull_tx_timeout(struct net_device *snull_dev) 
 {
     struct snull_priv *priv = netdev_priv(snull_dev);
-    /* Drop packets on transmission timeout */
-    spin_lock(&priv->lock);
-    priv->stats.tx_dropped++;
-    dev_kfree_skb(priv->skb);
-    spin_unlock(&priv->lock);
+    unsigned int i;
+
+    for (i = 0; i < priv->nqueues; i++)
+        napi_schedule(&priv->queues[i].napi);
     return;
 }
 
 static void snull_stats_64(struct net_device *snull_dev, struct rtnl_link_stats64 *storage) 
 {
     struct snull_priv *priv = netdev_priv(snull_dev);
-    storage->rx_packets = priv->stats.rx_packets;
-    storage->rx_dropped = priv->stats.rx_dropped;
-    storage->tx_packets = priv->stats.tx_packets;
-    storage->tx_dropped = priv->stats.tx_dropped;
-    storage->tx_bytes = priv->stats.tx_bytes;
-    storage->rx_bytes = priv->stats.rx_bytes;
+    u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+    struct snull_queue *q;
+    unsigned int start;
+    unsigned int i;
+
+    /* Drops are added from dev->{rx,tx}_dropped by the core */
+    for (i = 0; i < priv->nqueues; i++) {
+        q = &priv->queues[i];
+        do {
+            start = u64_stats_fetch_begin_irq(&q->syncp);
+            rx_packets = q->rx_packets;
+            rx_bytes = q->rx_bytes;
+            tx_packets = q->tx_packets;
+            tx_bytes = q->tx_bytes;
+        } while (u64_stats_fetch_retry_irq(&q->syncp, start));
+        storage->rx_packets += rx_packets;
+        storage->rx_bytes += rx_bytes;
+        storage->tx_packets += tx_packets;
+        storage->tx_bytes += tx_bytes;
+    }
 }
 
-static int snull_rx(struct net_device *snull_dev, struct snull_priv *priv, u8 *pkt, int pktlen) 
+/*
+   Puts the sender's skb into the RX ring without copying it,
+   snull_poll hands it to the stack. Consumes the skb.
+*/
+static int snull_rx(struct net_device *snull_dev, struct snull_queue *q, struct sk_buff *skb) 
 {
-    struct sk_buff *skb;
-    char *data;
-    int rx_ret;
-
-    if (!snull_dev || !priv) {
+    if (!snull_dev || !q) {
         pr_warn("DEVICE is NULL\n");
+        dev_kfree_skb_any(skb);
         return -1;
     }
 
-    /* Request skb memory */
-    skb = alloc_skb(pktlen + 2, GFP_ATOMIC);
-    if (unlikely(!skb)) {
-        pr_warn("Sufficient memory not available\n");
-        priv->stats.rx_dropped++;
-        spin_unlock(&priv->lock);
+    if (!netif_running(snull_dev)) {
+        atomic_long_inc(&snull_dev->rx_dropped);
+        dev_kfree_skb_any(skb);
         return -1;
     }
-    /* Reserve 2 bytes at head for word boundary alignment */
-    skb_reserve(skb, 2);
-    /* Make space for packet */
-    data = skb_put(skb, pktlen);
-    /* Copy packet */
-    memcpy(data, pkt, pktlen);
-    /* Update metadata */
-    skb->dev = snull_dev;
-    skb->protocol = eth_type_trans(skb, snull_dev);
-    pr_info("skb->protocol is %d\n", skb->protocol);
-    skb->ip_summed = CHECKSUM_UNNECESSARY;
-    /* Send packet to NW stack */
-    rx_ret = netif_rx(skb);
+
+    /* Transmit is complete as far as the sending socket is concerned */
+    skb_orphan(skb);
+    /*
+       Retarget to the receiving device: scrubs the sender's
+       state, sets skb->dev and pulls the Ethernet header.
+       Frees the skb and counts the drop on failure.
+    */
+    if (__dev_forward_skb(snull_dev, skb) != NET_RX_SUCCESS)
+        return -1;
+    /* Checksums were never damaged on this wire */
+    if (skb->ip_summed != CHECKSUM_PARTIAL)
+        skb->ip_summed = CHECKSUM_UNNECESSARY;
+    skb_record_rx_queue(skb, q->index);
+
+    /* Receiver is not keeping up, drop like a full NIC ring would */
+    if (!snull_ring_put(&q->rx_ring, skb, 0)) {
+        atomic_long_inc(&snull_dev->rx_dropped);
+        dev_kfree_skb_any(skb);
+        return -1;
+    }
+    return 0;
+}
+
+/* Completes transmitted descriptors and restarts the queue once there is room */
+static void snull_tx_clean(struct snull_queue *q)
+{
+    struct snull_ring *ring = &q->tx_ring;
+    struct net_device *dev = q->priv->dev;
+    struct netdev_queue *txq = netdev_get_tx_queue(dev, q->index);
+    unsigned int head = smp_load_acquire(&ring->head);
+    unsigned int tail = ring->tail;
+    u64 packets = 0, bytes = 0;
+
+    if (tail == head)
+        return;
+    for (; tail != head; tail++) {
+        /* The skb went to the peer, only stats are left */
+        packets++;
+        bytes += snull_ring_desc(ring, tail)->len;
+    }
+    smp_store_release(&ring->tail, tail);
+
+    /* Update transmission stats */
+    u64_stats_update_begin(&q->syncp);
+    q->tx_packets += packets;
+    q->tx_bytes += bytes;
+    u64_stats_update_end(&q->syncp);
+
+    /* Pairs with the barrier after netif_tx_stop_queue in xmit */
+    smp_mb();
+    if (netif_tx_queue_stopped(txq) &&
+        snull_ring_used(ring) <= SNULL_RING_SIZE - SNULL_TX_WAKE)
+        netif_tx_wake_queue(txq);
+}
+
+/*
+   NAPI poll, runs in softirq context. While it is scheduled
+   the queue's interrupt is effectively masked. Cleans TX
+   completions, delivers up to budget received packets
+   through GRO and only completes once both rings are drained.
+*/
+static int snull_poll(struct napi_struct *napi, int budget)
+{
+    struct snull_queue *q = container_of(napi, struct snull_queue, napi);
+    struct snull_ring *ring = &q->rx_ring;
+    unsigned int head, tail;
+    struct snull_desc *desc;
+    u64 bytes = 0;
+    int done = 0;
+
+    snull_tx_clean(q);
+
+    head = smp_load_acquire(&ring->head);
+    tail = ring->tail;
+    while (done < budget && tail != head) {
+        desc = snull_ring_desc(ring, tail++);
+        /* eth_type_trans already pulled the header */
+        bytes += desc->skb->len + ETH_HLEN;
+        /* Send packet to NW stack */
+        napi_gro_receive(napi, desc->skb);
+        desc->skb = NULL;
+        done++;
+    }
+    smp_store_release(&ring->tail, tail);
+
     /* Update statistics */
-    priv->stats.rx_packets++;
-    priv->stats.rx_bytes += pktlen;
-    return rx_ret;
+    u64_stats_update_begin(&q->syncp);
+    q->rx_packets += done;
+    q->rx_bytes += bytes;
+    u64_stats_update_end(&q->syncp);
+
+    if (done < budget && napi_complete_done(napi, done)) {
+        /*
+           Work posted after we looked found NAPI still
+           scheduled and raised no interrupt; the state change
+           in napi_complete_done orders this recheck
+        */
+        if (snull_ring_used(ring) || snull_ring_used(&q->tx_ring))
+            napi_schedule(napi);
+    }
+    return done;
 }
 
-/* Generic interrupt handler */
+/* Generic interrupt handler, one "IRQ" per queue */
 static void snull_interrupt_hdlr(int irq, void *dev_id, struct pt_regs *regs)
 {
-    struct net_device *snull_dev = (struct net_device *)dev_id;
-    struct snull_priv *priv = netdev_priv(snull_dev);
-    struct net_device *dest;
-    struct snull_priv *priv_dest;
+    struct snull_queue *q = (struct snull_queue *)dev_id;
     //int ret = 0; /* How do interrupt handlers handle return errors? */
-    int status;
-    u8 *pkt = NULL;
-    int pktlen;
+    unsigned long status;
 
-    dest = ((snull_dev == mydev[0]) ? mydev[1]:mydev[0]);
-    priv_dest = netdev_priv(dest);
-    spin_lock(&priv->lock);
-    /* Obtain packet from HW */
-    status = priv->status;
-    pr_info("netdev:%x status register value is %d \n", snull_dev, status);
-    priv->status = 0;
-    if (priv->rx_int_enabled && (status & RX_INT_ENABLED)) {
-        pkt = priv_dest->tx_packet;
-        pktlen = priv_dest->tx_packetlen;
-        /* Function that deals with the receive internals */
-        pr_info("Invoking snull_rx\n");
-        snull_rx(snull_dev, priv, pkt, pktlen);     
-        /* Signal to sender device that transmission was a success */
-        spin_lock(&priv_dest->lock);
-        status_update(priv_dest, TX_INT_ENABLED);
-        priv_dest->tx_int_enabled = 1;
-        spin_unlock(&priv_dest->lock);
-        priv->rx_int_enabled = 0;
-        pkt = NULL;
-    } else if (priv->tx_int_enabled && (status & TX_INT_ENABLED)) {
-        pr_info("Inside tx_hdlr  \n");
-        /* Update transmission stats and free skb */
-        priv->stats.tx_packets++;
-        priv->stats.tx_bytes += priv->tx_packetlen;
-        //pkt = priv->tx_packet;
-        dev_kfree_skb_irq(priv->skb);
-        priv->tx_int_enabled = 0;
-    }
-    spin_unlock(&priv->lock);
-    //if(pkt)
-      //  kfree(pkt);
+    /* Read and acknowledge the status register */
+    status = xchg(&q->status, 0);
+    /*
+       Both RX and TX completions are handled from NAPI,
+       which stays scheduled (masking this) until drained
+    */
+    if (status)
+        napi_schedule(&q->napi);
 }
 
 struct net_device_ops snull_ops = {
@@ -284,22 +580,42 @@ struct net_device_ops snull_ops = {
 static void dev_bringup(struct net_device *dev) 
 {
     struct snull_priv *priv;
+    struct snull_queue *q;
+    unsigned int i;
     /* Sets up broad ethernet layer default settings */
     ether_setup(dev); 
     /* Custom device settings */
     dev->netdev_ops = &snull_ops;
     dev->watchdog_timeo = timeout;
     dev->flags |= IFF_NOARP;
-    dev->features |= NETIF_F_HW_CSUM;
+    /*
+       Without SG and TSO the stack segments every TCP flow
+       into MTU sized skbs before xmit sees them. The peer
+       receives the super-packet as is, so nothing is ever
+       segmented here. Offloads turned off through ethtool
+       are done in software by validate_xmit_skb() instead.
+    */
+    dev->features |= SNULL_FEATURES;
+    dev->hw_features |= SNULL_FEATURES;
+    dev->max_mtu = ETH_MAX_MTU;
+    dev->mtu = clamp_t(unsigned int, mtu, ETH_MIN_MTU, ETH_MAX_MTU);
     /* NETIF_F_NO_CSUM not supported in v5.4.70 
        dev->hard_header_cache not supported
     dev->features |= NETIF_F_NO_CSUM;
     dev->hard_header_cache = NULL;
     */
-    /* Initialize device private memory */
+    /* Initialize device private memory, queues follow struct snull_priv */
     priv = netdev_priv(dev);
-    memset(priv, 0, sizeof(struct snull_priv));
-    spin_lock_init(&priv->lock);
+    memset(priv, 0, struct_size(priv, queues, snull_nqueues));
+    priv->dev = dev;
+    priv->nqueues = snull_nqueues;
+    for (i = 0; i < priv->nqueues; i++) {
+        q = &priv->queues[i];
+        q->priv = priv;
+        q->index = i;
+        u64_stats_init(&q->syncp);
+        netif_napi_add(dev, &q->napi, snull_poll, NAPI_POLL_WEIGHT);
+    }
 }
 
 /*  
@@ -310,11 +626,19 @@ static void dev_bringup(struct net_device *dev)
 */
 static int __init init_nw(void)
 {
+    struct snull_priv *priv;
+    size_t priv_size;
     int i;
+
+    /* One TX/RX queue pair per CPU */
+    snull_nqueues = min_t(unsigned int, num_possible_cpus(), SNULL_MAX_QUEUES);
+    priv_size = struct_size(priv, queues, snull_nqueues);
     /* Initialize the devices the driver handles */
-    mydev[0] = alloc_netdev(sizeof(struct snull_priv), "ldd%d", NET_NAME_UNKNOWN, dev_bringup);
+    mydev[0] = alloc_netdev_mqs(priv_size, "ldd%d", NET_NAME_UNKNOWN, dev_bringup,
+                                snull_nqueues, snull_nqueues);
     pr_info("Init mydev[0]\n");
-    mydev[1] = alloc_netdev(sizeof(struct snull_priv), "ldd%d", NET_NAME_UNKNOWN, dev_bringup);
+    mydev[1] = alloc_netdev_mqs(priv_size, "ldd%d", NET_NAME_UNKNOWN, dev_bringup,
+                                snull_nqueues, snull_nqueues);
     pr_info("Init mydev[1]\n");
     if (!mydev[0] || !mydev[1]) {
         pr_alert("Failed to allocate resources for device \n");
@@ -331,23 +655,34 @@ static int __init init_nw(void)
     return 0;
     /* Reclaim resources */
 err:
+    /* Unregister both before freeing either, as in exit_nw */
     for (i = 0; i < 2; i++)
-        if (mydev[i]) {
+        if (mydev[i] && mydev[i]->reg_state == NETREG_REGISTERED)
             unregister_netdev(mydev[i]);
+    for (i = 0; i < 2; i++)
+        if (mydev[i])
             free_netdev(mydev[i]);
-        }
     return -1;
 }
 
 /*
-    Frees the device resources
+    Frees the device resources. Each device reaches into
+    its peer on transmit, so both are unregistered (and
+    so stopped) before either is freed.
 */
 static void __exit exit_nw(void)
 {
+    LIST_HEAD(list);
     int i;
+
+    rtnl_lock();
+    for (i = 0; i < 2; i++)
+        if (mydev[i])
+            unregister_netdevice_queue(mydev[i], &list);
+    unregister_netdevice_many(&list);
+    rtnl_unlock();
     for (i = 0; i < 2; i++)
         if (mydev[i]) {
-            unregister_netdev(mydev[i]);
             free_netdev(mydev[i]);
             pr_info("Unregister mydev[%d]\n", i);
         }